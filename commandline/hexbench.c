@@ -0,0 +1,347 @@
+/* Name: hexbench.c
+ * Project: AVR bootloader HID
+ * Creation Date: 2026-10-16
+ * Tabsize: 4
+ * Copyright: (c) 2007 by OBJECTIVE DEVELOPMENT Software GmbH
+ * License: Proprietary, free under certain conditions. See Documentation.
+ */
+
+/*
+General Description:
+Benchmark for the Intel-Hex loader. A synthetic hex file of the requested size
+is generated and parsed with parseIntelHex() and with the previous getc() and
+strtol() based parser. The throughput of both is printed in MB/s.
+Afterwards the images of both parsers are compared with the data written to
+the file, as are the images of a sparse file and of a file with extended
+segment and linear address records (parseIntelHex() only, the old parser
+knows no extended addresses). The exit status is 1 if any of them differs.
+Usage: hexbench [<size in MB> [<file name>]]
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include "hexfile.h"
+
+static char dataBuffer[65536 + 256];
+
+#define REF_SIZE    0x40000     /* address range of the test files */
+
+static unsigned char    refData[REF_SIZE];  /* what the file contains */
+static char             refUsed[REF_SIZE];  /* non-zero if written by the file */
+static int              refStart, refEnd;
+
+/* ------------------------------------------------------------------------- */
+/* The parser as it was before hexfile.c was introduced, for comparison.     */
+
+static int  parseUntilColon(FILE *fp)
+{
+int c;
+
+    do{
+        c = getc(fp);
+    }while(c != ':' && c != EOF);
+    return c;
+}
+
+static int  parseHex(FILE *fp, int numDigits)
+{
+int     i;
+char    temp[9];
+
+    for(i = 0; i < numDigits; i++)
+        temp[i] = getc(fp);
+    temp[i] = 0;
+    return strtol(temp, NULL, 16);
+}
+
+static int  legacyParseIntelHex(char *hexfile, char buffer[65536 + 256], int *startAddr, int *endAddr)
+{
+int     address, base, d, segment, i, lineLen, sum;
+FILE    *input;
+
+    input = fopen(hexfile, "r");
+    if(input == NULL)
+        return 1;
+    while(parseUntilColon(input) == ':'){
+        sum = 0;
+        sum += lineLen = parseHex(input, 2);
+        base = address = parseHex(input, 4);
+        sum += address >> 8;
+        sum += address;
+        sum += segment = parseHex(input, 2);  /* segment value? */
+        if(segment != 0)    /* ignore lines where this byte is not 0 */
+            continue;
+        for(i = 0; i < lineLen ; i++){
+            d = parseHex(input, 2);
+            buffer[address++] = d;
+            sum += d;
+        }
+        sum += parseHex(input, 2);
+        if((sum & 0xff) != 0){
+            fprintf(stderr, "Warning: Checksum error between address 0x%x and 0x%x\n", base, address);
+        }
+        if(*startAddr > base)
+            *startAddr = base;
+        if(*endAddr < address)
+            *endAddr = address;
+    }
+    fclose(input);
+    return 0;
+}
+
+/* ------------------------------------------------------------------------- */
+
+static void refReset(void)
+{
+    memset(refData, 0xff, sizeof(refData));
+    memset(refUsed, 0, sizeof(refUsed));
+    refStart = REF_SIZE;
+    refEnd = 0;
+}
+
+/* Writes one record with the 16 bit 'address' and notes data bytes at
+ * 'base' + 'address' in the reference. Returns the number of characters.
+ */
+static int  writeRecord(FILE *fp, int type, int base, int address, unsigned char *data, int len)
+{
+int i, sum = len + (address >> 8) + address + type;
+
+    fprintf(fp, ":%02X%04X%02X", len, address & 0xffff, type);
+    for(i = 0; i < len; i++){
+        fprintf(fp, "%02X", data[i]);
+        sum += data[i];
+    }
+    fprintf(fp, "%02X\n", -sum & 0xff);
+    if(type == 0){
+        address += base;
+        memcpy(refData + address, data, len);
+        memset(refUsed + address, 1, len);
+        if(refStart > address)
+            refStart = address;
+        if(refEnd < address + len)
+            refEnd = address + len;
+    }
+    return 12 + 2 * len;
+}
+
+static long writeTestFile(char *name, long size)
+{
+FILE            *fp;
+long            written = 0;
+int             address = 0, i;
+unsigned char   data[16];
+
+    if((fp = fopen(name, "w")) == NULL){
+        perror(name);
+        return -1;
+    }
+    refReset();
+    srand(1);
+    while(written < size){
+        for(i = 0; i < 16; i++)
+            data[i] = rand() & 0xff;
+        written += writeRecord(fp, 0, 0, address, data, 16);
+        address = (address + 16) & 0xffff;
+    }
+    written += writeRecord(fp, 1, 0, 0, NULL, 0);
+    fclose(fp);
+    return written;
+}
+
+/* Data with gaps: partial blocks, a record across a block boundary and the
+ * end of the 16 bit address range.
+ */
+static int  writeSparseFile(char *name)
+{
+FILE            *fp;
+unsigned char   data[32];
+int             i;
+
+    if((fp = fopen(name, "w")) == NULL){
+        perror(name);
+        return -1;
+    }
+    refReset();
+    for(i = 0; i < 32; i++)
+        data[i] = i * 7;
+    writeRecord(fp, 0, 0, 0x0000, data, 32);
+    writeRecord(fp, 0, 0, 0x1234, data, 16);
+    writeRecord(fp, 0, 0, 0x207c, data + 3, 8);
+    writeRecord(fp, 0, 0, 0xfff0, data + 16, 16);
+    writeRecord(fp, 1, 0, 0, NULL, 0);
+    fclose(fp);
+    return 0;
+}
+
+/* Data above 64 kB, addressed with extended segment (type 2) and extended
+ * linear (type 4) address records.
+ */
+static int  writeExtendedFile(char *name)
+{
+FILE            *fp;
+unsigned char   data[16];
+int             i;
+
+    if((fp = fopen(name, "w")) == NULL){
+        perror(name);
+        return -1;
+    }
+    refReset();
+    for(i = 0; i < 16; i++)
+        data[i] = 0xa0 + i;
+    writeRecord(fp, 0, 0, 0x0040, data, 16);
+    data[0] = 0x10;     /* segment 0x1000 -> 0x10000 */
+    data[1] = 0x00;
+    writeRecord(fp, 2, 0, 0, data, 2);
+    data[0] = 0xa0;
+    writeRecord(fp, 0, 0x10000, 0x0010, data, 16);
+    data[0] = 0x00;     /* upper address 0x0002 -> 0x20000 */
+    data[1] = 0x02;
+    writeRecord(fp, 4, 0, 0, data, 2);
+    data[0] = 0xa0;
+    data[1] = 0xa1;
+    writeRecord(fp, 0, 0x20000, 0x0100, data, 16);
+    writeRecord(fp, 0, 0x20000, 0xfff0, data, 16);
+    writeRecord(fp, 1, 0, 0, NULL, 0);
+    fclose(fp);
+    return 0;
+}
+
+/* ------------------------------------------------------------------------- */
+
+/* Compares the image of parseIntelHex() with the reference: address range,
+ * touched blocks (pointer and bitmap) and all bytes of touched blocks.
+ */
+static int  checkImage(char *name, char *label)
+{
+image_t         *image;
+unsigned char   *block;
+int             address, i, used, errors = 0;
+
+    if((image = imageNew()) == NULL || parseIntelHex(name, image) != 0){
+        fprintf(stderr, "%s: parsing failed\n", label);
+        imageFree(image);
+        return 1;
+    }
+    if(image->startAddr != refStart || image->endAddr != refEnd){
+        fprintf(stderr, "%s: range 0x%x ... 0x%x instead of 0x%x ... 0x%x\n", label, image->startAddr, image->endAddr, refStart, refEnd);
+        errors++;
+    }
+    for(address = 0; address < REF_SIZE && errors < 10; address += IMAGE_BLOCK_SIZE){
+        for(used = i = 0; i < IMAGE_BLOCK_SIZE; i++)
+            used |= refUsed[address + i];
+        block = imageBlock(image, address);
+        if(!used != (block == NULL) || !used != (imageNextBlock(image, address) != address)){
+            fprintf(stderr, "%s: block 0x%x is %stouched\n", label, address, used ? "not " : "");
+            errors++;
+            continue;
+        }
+        for(i = 0; block != NULL && i < IMAGE_BLOCK_SIZE; i++){
+            if(block[i] != refData[address + i]){
+                fprintf(stderr, "%s: 0x%02x instead of 0x%02x at 0x%x\n", label, block[i], refData[address + i], address + i);
+                errors++;
+                break;
+            }
+        }
+    }
+    if(imageNextBlock(image, REF_SIZE) != -1){
+        fprintf(stderr, "%s: blocks beyond the file's data\n", label);
+        errors++;
+    }
+    imageFree(image);
+    return errors != 0;
+}
+
+/* Compares the buffer of the previous parser with the reference. */
+static int  checkLegacy(char *name, char *label)
+{
+int startAddress = sizeof(dataBuffer), endAddress = 0, i;
+
+    memset(dataBuffer, -1, sizeof(dataBuffer));
+    if(legacyParseIntelHex(name, dataBuffer, &startAddress, &endAddress) != 0){
+        fprintf(stderr, "%s: parsing failed\n", label);
+        return 1;
+    }
+    if(startAddress != refStart || endAddress != refEnd){
+        fprintf(stderr, "%s: range 0x%x ... 0x%x instead of 0x%x ... 0x%x\n", label, startAddress, endAddress, refStart, refEnd);
+        return 1;
+    }
+    for(i = 0; i < 65536; i++){
+        if((unsigned char)dataBuffer[i] != refData[i]){
+            fprintf(stderr, "%s: 0x%02x instead of 0x%02x at 0x%x\n", label, dataBuffer[i] & 0xff, refData[i], i);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int  runLegacyParser(char *name)
+{
+int     startAddress = sizeof(dataBuffer), endAddress = 0;
+
+    memset(dataBuffer, -1, sizeof(dataBuffer));
+    return legacyParseIntelHex(name, dataBuffer, &startAddress, &endAddress);
+}
+
+static int  runCurrentParser(char *name)
+{
+image_t *image;
+int     rval;
+
+    if((image = imageNew()) == NULL)
+        return 1;
+    rval = parseIntelHex(name, image);
+    imageFree(image);
+    return rval;
+}
+
+static double   runParser(int (*parser)(char *), char *name, long size, char *label)
+{
+clock_t start;
+double  seconds;
+
+    start = clock();
+    if(parser(name) != 0){
+        fprintf(stderr, "%s: parsing failed\n", label);
+        return 0;
+    }
+    seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+    if(seconds <= 0)
+        seconds = 1.0 / CLOCKS_PER_SEC;
+    printf("%-8s %8.3f s  %8.1f MB/s\n", label, seconds, size / seconds / (1024 * 1024));
+    return seconds;
+}
+
+int main(int argc, char **argv)
+{
+long    size = 64;
+char    *name = "hexbench.hex";
+double  legacy, current;
+int     errors = 0;
+
+    if(argc > 1)
+        size = atol(argv[1]);
+    if(argc > 2)
+        name = argv[2];
+    if((size = writeTestFile(name, size * 1024 * 1024)) < 0)
+        return 1;
+    printf("Parsing %ld bytes of Intel-Hex data\n", size);
+    legacy = runParser(runLegacyParser, name, size, "legacy");
+    current = runParser(runCurrentParser, name, size, "current");
+    if(legacy > 0 && current > 0)
+        printf("speedup  %8.1fx\n", legacy / current);
+    errors += checkLegacy(name, "legacy image") + checkImage(name, "current image");
+    if(writeSparseFile(name) != 0)
+        return 1;
+    errors += checkLegacy(name, "legacy sparse") + checkImage(name, "current sparse");
+    if(writeExtendedFile(name) != 0)
+        return 1;
+    errors += checkImage(name, "current extended");
+    remove(name);
+    printf("images   %s\n", errors ? "DIFFER" : "match");
+    return errors != 0;
+}
+
+/* ------------------------------------------------------------------------- */
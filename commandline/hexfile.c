@@ -0,0 +1,194 @@
+/* Name: hexfile.c
+ * Project: AVR bootloader HID
+ * Creation Date: 2026-10-16
+ * Tabsize: 4
+ * Copyright: (c) 2007 by OBJECTIVE DEVELOPMENT Software GmbH
+ * License: Proprietary, free under certain conditions. See Documentation.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#if !defined(WIN32)
+#   include <sys/types.h>
+#   include <sys/stat.h>
+#   include <sys/mman.h>
+#   include <fcntl.h>
+#   include <unistd.h>
+#endif
+#include "hexfile.h"
+
+/* ------------------------------------------------------------------------- */
+
+#define BAD_DIGIT   0x1000  /* any bit above 0xff marks a decoding error */
+
+#define HEX_RECORD_DATA         0
+#define HEX_RECORD_EOF          1
+#define HEX_RECORD_EXT_SEGMENT  2
+#define HEX_RECORD_EXT_LINEAR   4
+
+static short    hexDigitValue[256];
+
+static void initHexDigitValue(void)
+{
+int i;
+
+    for(i = 0; i < 256; i++){
+        if(i >= '0' && i <= '9'){
+            hexDigitValue[i] = i - '0';
+        }else if(i >= 'a' && i <= 'f'){
+            hexDigitValue[i] = i - 'a' + 10;
+        }else if(i >= 'A' && i <= 'F'){
+            hexDigitValue[i] = i - 'A' + 10;
+        }else{
+            hexDigitValue[i] = BAD_DIGIT;
+        }
+    }
+}
+
+/* Decodes two hex digits. The result has bits above 0xff set if one of the
+ * characters is not a hex digit.
+ */
+static inline int   hexByte(const unsigned char *p)
+{
+    return (hexDigitValue[p[0]] << 4) | hexDigitValue[p[1]];
+}
+
+/* ------------------------------------------------------------------------- */
+
+/* Makes the entire file available in memory. We use a read-only mapping where
+ * available and fall back to reading the file into a heap buffer.
+ */
+static const unsigned char  *mapFile(char *name, size_t *size)
+{
+#if defined(WIN32)
+FILE            *fp;
+long            len;
+unsigned char   *data;
+
+    if((fp = fopen(name, "rb")) == NULL)
+        return NULL;
+    fseek(fp, 0, SEEK_END);
+    len = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    if(len < 0 || (data = malloc(len + 1)) == NULL){
+        fclose(fp);
+        return NULL;
+    }
+    *size = fread(data, 1, len, fp);
+    fclose(fp);
+    return data;
+#else
+int         fd;
+struct stat st;
+void        *data;
+
+    if((fd = open(name, O_RDONLY)) < 0)
+        return NULL;
+    if(fstat(fd, &st) != 0){
+        close(fd);
+        return NULL;
+    }
+    *size = st.st_size;
+    if(*size == 0){     /* mmap() refuses empty mappings */
+        close(fd);
+        return (const unsigned char *)"";
+    }
+    data = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    return data == MAP_FAILED ? NULL : data;
+#endif
+}
+
+static void unmapFile(const unsigned char *data, size_t size)
+{
+#if defined(WIN32)
+    free((void *)data);
+#else
+    if(size > 0)
+        munmap((void *)data, size);
+#endif
+}
+
+/* ------------------------------------------------------------------------- */
+
+int parseIntelHex(char *hexfile, image_t *image)
+{
+const unsigned char *input, *p, *end;
+unsigned char       record[256];
+size_t              size;
+int                 d, hi, lo, type, i, lineLen, sum, check, value, rval = 0;
+unsigned long       base = 0, extAddress = 0;
+
+    if(hexDigitValue[0] == 0)
+        initHexDigitValue();
+    if((input = mapFile(hexfile, &size)) == NULL){
+        fprintf(stderr, "error opening %s: %s\n", hexfile, strerror(errno));
+        return 1;
+    }
+    end = input + size;
+    for(p = input; (p = memchr(p, ':', end - p)) != NULL; ){
+        /* a record needs at least ':', length, address, type and checksum */
+        if(end - p < 11 || ((lineLen = hexByte(p + 1)) <= 0xff && end - p < 11 + 2 * lineLen)){
+            fprintf(stderr, "Truncated record at offset %ld in %s\n", (long)(p - input), hexfile);
+            rval = 1;
+            break;
+        }
+        hi = hexByte(p + 3);
+        lo = hexByte(p + 5);
+        type = hexByte(p + 7);
+        if((lineLen | hi | lo | type) & ~0xff){
+            check = BAD_DIGIT;
+        }else{
+            base = extAddress + ((hi << 8) | lo);
+            if(type == HEX_RECORD_DATA && base + lineLen > HEXFILE_MAX_ADDRESS){
+                fprintf(stderr, "Address 0x%lx in %s exceeds the 24 bit address range\n", base, hexfile);
+                rval = 1;
+                break;
+            }
+            sum = lineLen + hi + lo + type;
+            check = 0;
+            value = 0;
+            p += 9;
+            for(i = 0; i < lineLen; i++){
+                d = hexByte(p);
+                check |= d;
+                record[i] = d;
+                if(i < 2)   /* address records carry a 16 bit big endian value */
+                    value = (value << 8) | (d & 0xff);
+                sum += d;
+                p += 2;
+            }
+            check |= d = hexByte(p);
+            sum += d;
+            p += 2;
+        }
+        if(check & ~0xff){
+            fprintf(stderr, "Invalid character in record at offset %ld in %s\n", (long)(p - input), hexfile);
+            rval = 1;
+            break;
+        }
+        if((sum & 0xff) != 0){
+            fprintf(stderr, "Warning: Checksum error between address 0x%lx and 0x%lx\n", base, base + lineLen);
+        }
+        if(type == HEX_RECORD_EOF){
+            break;
+        }else if(type == HEX_RECORD_EXT_SEGMENT){
+            extAddress = (unsigned long)value << 4;
+        }else if(type == HEX_RECORD_EXT_LINEAR){
+            extAddress = (unsigned long)value << 16;
+        }else if(type == HEX_RECORD_DATA){
+            if(imageWrite(image, (int)base, record, lineLen)){
+                fprintf(stderr, "Out of memory loading %s\n", hexfile);
+                rval = 1;
+                break;
+            }
+        }
+        /* start address records (03 and 05) are meaningless for us */
+    }
+    unmapFile(input, size);
+    return rval;
+}
+
+/* ------------------------------------------------------------------------- */
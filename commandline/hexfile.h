@@ -0,0 +1,41 @@
+/* Name: hexfile.h
+ * Project: AVR bootloader HID
+ * Creation Date: 2026-10-16
+ * Tabsize: 4
+ * Copyright: (c) 2007 by OBJECTIVE DEVELOPMENT Software GmbH
+ * License: Proprietary, free under certain conditions. See Documentation.
+ */
+
+#ifndef __hexfile_h_INCLUDED__
+#define __hexfile_h_INCLUDED__
+
+#include "image.h"
+
+/*
+General Description:
+This module loads Intel-Hex files. The file is mapped into memory as a whole
+(read into a heap buffer where mmap() is not available) and decoded in a single
+pass with a lookup table for hex digits. The checksum of every record is
+validated.
+*/
+
+/* ------------------------------------------------------------------------ */
+
+#define HEXFILE_MAX_ADDRESS IMAGE_MAX_ADDRESS
+/* Upper limit for addresses in a hex file. The boot loader protocol transfers
+ * 24 bit addresses.
+ */
+
+int parseIntelHex(char *hexfile, image_t *image);
+/* This function loads the Intel-Hex file 'hexfile' into 'image'. Data records
+ * (type 00) are stored at the address given by the most recent Extended
+ * Segment (02) or Extended Linear (04) Address record. Parsing stops at the
+ * End Of File (01) record. Records with a bad checksum are stored anyway, but
+ * a warning is printed.
+ * Returns: 0 on success, 1 if the file could not be read or contains a
+ * malformed record. An error message is printed in this case.
+ */
+
+/* ------------------------------------------------------------------------ */
+
+#endif /* __hexfile_h_INCLUDED__ */
@@ -42,6 +42,9 @@ BOOLEAN __stdcall   HidD_GetSerialNumberString(IN HANDLE device, OUT void *buffe
 BOOLEAN __stdcall   HidD_GetFeature(IN HANDLE device, OUT void *reportBuffer, IN ULONG bufferLen);
 BOOLEAN __stdcall   HidD_SetFeature(IN HANDLE device, IN void *reportBuffer, IN ULONG bufferLen);
 
+BOOLEAN __stdcall   HidD_GetPreparsedData(IN HANDLE device, OUT PHIDP_PREPARSED_DATA *preparsedData);
+BOOLEAN __stdcall   HidD_FreePreparsedData(IN PHIDP_PREPARSED_DATA preparsedData);
+
 BOOLEAN __stdcall   HidD_GetNumInputBuffers(IN HANDLE device, OUT ULONG *numBuffers);
 BOOLEAN __stdcall   HidD_SetNumInputBuffers(IN HANDLE device, OUT ULONG numBuffers);
 
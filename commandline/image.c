@@ -0,0 +1,162 @@
+/* Name: image.c
+ * Project: AVR bootloader HID
+ * Creation Date: 2026-10-16
+ * Tabsize: 4
+ * Copyright: (c) 2007 by OBJECTIVE DEVELOPMENT Software GmbH
+ * License: Proprietary, free under certain conditions. See Documentation.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "image.h"
+
+#define BITS_PER_WORD   (8 * (int)sizeof(unsigned))
+
+/* ------------------------------------------------------------------------- */
+
+image_t *imageNew(void)
+{
+image_t *image;
+
+    if((image = calloc(1, sizeof(image_t))) == NULL)
+        return NULL;
+    image->startAddr = 0x7fffffff;
+    return image;
+}
+
+void    imageFree(image_t *image)
+{
+int i;
+
+    if(image == NULL)
+        return;
+    for(i = 0; i < image->numBlocks; i++)
+        free(image->blocks[i]);
+    free(image->blocks);
+    free(image->touched);
+    free(image);
+}
+
+/* Grows the block index so that it contains 'numBlocks' entries. The index
+ * grows in steps of 512 blocks (64 kB) to keep the number of reallocations
+ * low.
+ */
+static int  growIndex(image_t *image, int numBlocks)
+{
+unsigned char   **blocks;
+unsigned        *touched;
+int             oldWords, newWords;
+
+    if(numBlocks <= image->numBlocks)
+        return 0;
+    if(numBlocks > IMAGE_MAX_ADDRESS / IMAGE_BLOCK_SIZE)
+        return 1;
+    numBlocks = (numBlocks + 511) & ~511;
+    if((blocks = realloc(image->blocks, numBlocks * sizeof(*blocks))) == NULL)
+        return 1;
+    memset(blocks + image->numBlocks, 0, (numBlocks - image->numBlocks) * sizeof(*blocks));
+    image->blocks = blocks;
+    oldWords = image->numBlocks / BITS_PER_WORD;
+    newWords = numBlocks / BITS_PER_WORD;
+    if((touched = realloc(image->touched, newWords * sizeof(*touched))) == NULL)
+        return 1;
+    memset(touched + oldWords, 0, (newWords - oldWords) * sizeof(*touched));
+    image->touched = touched;
+    image->numBlocks = numBlocks;
+    return 0;
+}
+
+int     imageWrite(image_t *image, int address, unsigned char *data, int len)
+{
+int             index, offset, n;
+unsigned char   *block;
+
+    if(len <= 0)
+        return 0;
+    if(address < 0 || address >= IMAGE_MAX_ADDRESS || len > IMAGE_MAX_ADDRESS - address)
+        return -1;
+    if(growIndex(image, (address + len + IMAGE_BLOCK_SIZE - 1) / IMAGE_BLOCK_SIZE))
+        return 1;
+    if(image->startAddr > address)
+        image->startAddr = address;
+    if(image->endAddr < address + len)
+        image->endAddr = address + len;
+    while(len > 0){
+        index = address / IMAGE_BLOCK_SIZE;
+        offset = address % IMAGE_BLOCK_SIZE;
+        if((block = image->blocks[index]) == NULL){
+            if((block = malloc(IMAGE_BLOCK_SIZE)) == NULL)
+                return 1;
+            memset(block, 0xff, IMAGE_BLOCK_SIZE);
+            image->blocks[index] = block;
+            image->touched[index / BITS_PER_WORD] |= 1u << (index % BITS_PER_WORD);
+            image->usedBlocks++;
+        }
+        n = IMAGE_BLOCK_SIZE - offset;
+        if(n > len)
+            n = len;
+        memcpy(block + offset, data, n);
+        address += n;
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+unsigned char   *imageBlock(image_t *image, int address)
+{
+int index = address / IMAGE_BLOCK_SIZE;
+
+    if(address < 0 || index >= image->numBlocks)
+        return NULL;
+    return image->blocks[index];
+}
+
+int     imageNextBlock(image_t *image, int address)
+{
+int         index, word;
+unsigned    bits;
+
+    if(address < 0)
+        address = 0;
+    index = (address + IMAGE_BLOCK_SIZE - 1) / IMAGE_BLOCK_SIZE;
+    if(index >= image->numBlocks)
+        return -1;
+    word = index / BITS_PER_WORD;
+    bits = image->touched[word] & (~0u << (index % BITS_PER_WORD));
+    while(bits == 0){   /* skip untouched regions one word at a time */
+        if(++word >= image->numBlocks / BITS_PER_WORD)
+            return -1;
+        bits = image->touched[word];
+    }
+    index = word * BITS_PER_WORD;
+    while(!(bits & 1)){
+        bits >>= 1;
+        index++;
+    }
+    return index * IMAGE_BLOCK_SIZE;
+}
+
+unsigned    imageCrc(image_t *image, int startAddr, int endAddr)
+{
+unsigned char   *block = NULL;
+unsigned        crc = 0xffff;
+int             address, bit;
+
+    for(address = startAddr; address < endAddr; address++){
+        if(address == startAddr || address % IMAGE_BLOCK_SIZE == 0)
+            block = imageBlock(image, address);
+        crc ^= block != NULL ? block[address % IMAGE_BLOCK_SIZE] : 0xff;
+        for(bit = 0; bit < 8; bit++)
+            crc = (crc & 1) ? (crc >> 1) ^ 0xa001 : crc >> 1;
+    }
+    return ~crc & 0xffff;
+}
+
+unsigned    imageBlockCrc(image_t *image, int address)
+{
+    address -= address % IMAGE_BLOCK_SIZE;
+    return imageCrc(image, address, address + IMAGE_BLOCK_SIZE);
+}
+
+/* ------------------------------------------------------------------------- */
@@ -0,0 +1,71 @@
+/* Name: image.h
+ * Project: AVR bootloader HID
+ * Creation Date: 2026-10-16
+ * Tabsize: 4
+ * Copyright: (c) 2007 by OBJECTIVE DEVELOPMENT Software GmbH
+ * License: Proprietary, free under certain conditions. See Documentation.
+ */
+
+#ifndef __image_h_INCLUDED__
+#define __image_h_INCLUDED__
+
+/*
+General Description:
+This module holds a sparse flash image. Memory is allocated in blocks of
+IMAGE_BLOCK_SIZE bytes (the unit transferred by the boot loader) and only for
+blocks which are actually written. A bitmap records which blocks have been
+touched so that gaps between code and data sections can be skipped quickly.
+*/
+
+/* ------------------------------------------------------------------------ */
+
+#define IMAGE_BLOCK_SIZE    128
+/* Size of the data payload in one boot loader data report. */
+
+#define IMAGE_MAX_ADDRESS   0x1000000
+/* Images cover at most the 24 bit address range of the boot loader protocol.
+ */
+
+typedef struct image{
+    unsigned char   **blocks;   /* indexed by address / IMAGE_BLOCK_SIZE */
+    unsigned        *touched;   /* bitmap of allocated blocks */
+    int             numBlocks;  /* number of entries in 'blocks' */
+    int             usedBlocks; /* number of allocated blocks */
+    int             startAddr;  /* lowest address written */
+    int             endAddr;    /* highest address written + 1 */
+}image_t;
+
+/* ------------------------------------------------------------------------ */
+
+image_t *imageNew(void);
+/* Creates an empty image. Returns NULL if out of memory.
+ */
+void    imageFree(image_t *image);
+/* Frees the image and all blocks. 'image' may be NULL.
+ */
+int     imageWrite(image_t *image, int address, unsigned char *data, int len);
+/* Stores 'len' bytes from 'data' at 'address'. Bytes of a block which are
+ * never written read as 0xff.
+ * Returns: 0 on success, 1 if out of memory, -1 if the bytes are not between
+ * 0 and IMAGE_MAX_ADDRESS.
+ */
+unsigned char   *imageBlock(image_t *image, int address);
+/* Returns the block containing 'address' or NULL if the block has not been
+ * touched. The returned pointer points to the start of the block.
+ */
+int     imageNextBlock(image_t *image, int address);
+/* Returns the start address of the first touched block at or above 'address'
+ * or -1 if there is none.
+ */
+unsigned    imageCrc(image_t *image, int startAddr, int endAddr);
+/* Returns the CRC16 of the bytes from 'startAddr' up to 'endAddr' as computed
+ * by the boot loader (the USB data CRC: polynomial 0xa001, initial value
+ * 0xffff, complemented result). Untouched blocks are treated as all 0xff.
+ */
+unsigned    imageBlockCrc(image_t *image, int address);
+/* Returns the CRC16 of the block containing 'address', see imageCrc().
+ */
+
+/* ------------------------------------------------------------------------ */
+
+#endif /* __image_h_INCLUDED__ */
@@ -12,7 +12,17 @@
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <stddef.h>
+#include <stdarg.h>
+#if defined(WIN32)
+#   include <windows.h>
+#else
+#   include <sys/time.h>
+#   include <time.h>
+#   include <pthread.h>
+#endif
 #include "usbcalls.h"
+#include "hexfile.h"
 
 #define IDENT_VENDOR_NUM        0x16c0
 #define IDENT_VENDOR_STRING     "obdev.at"
@@ -21,77 +31,79 @@
 
 /* ------------------------------------------------------------------------- */
 
-static char dataBuffer[65536 + 256];    /* buffer for file data */
-static int  startAddress, endAddress;
-static char leaveBootLoader = 0;
+static image_t  *image;                 /* file data */
+static image_t  *eepromImage;           /* --eeprom file data */
+static char     leaveBootLoader = 0;
+static char     verifyAfterWrite = 0;
+static char     *deviceSerial;          /* serial number, NULL for any */
+static char     waitForDevice = 0;
+static int      waitTimeout = 0;        /* seconds, 0 waits forever */
+static char     allDevices = 0;
+static char     quiet = 0;              /* suppress progress output */
+static char     measureExit = 0;        /* --exit-time */
+static int      appVendor, appProduct;  /* --from-app, vendor is 0 if not given */
+static int      appReportId = 0;
+static int      targetSignature = -1;   /* --mcu, -1 if not given */
+static char     statsFormat = 0;        /* --stats, STATS_TEXT or STATS_JSON */
 
-/* ------------------------------------------------------------------------- */
+#define STATS_TEXT      1
+#define STATS_JSON      2
 
-static int  parseUntilColon(FILE *fp)
-{
-int c;
+#define MAX_DEVICES     64
+#define MAX_USB_DEVICES 128     /* devices of any kind watched by --exit-time */
+#define EXIT_TIME_LIMIT 5       /* seconds to wait for the application */
+#define EXIT_POLL_MS    5
+#define FROM_APP_WAIT   10      /* seconds to wait for the boot loader after --from-app */
+#define FROM_APP_MAGIC  "BOOT"  /* data of the request sent to the application */
 
-    do{
-        c = getc(fp);
-    }while(c != ':' && c != EOF);
-    return c;
-}
+static char     deviceLocations[MAX_DEVICES][USB_LOCATION_LEN];   /* --path */
+static int      numDeviceLocations = 0;
+static char     deviceLocationDone[MAX_DEVICES];    /* a result was printed for this --path */
 
-static int  parseHex(FILE *fp, int numDigits)
-{
-int     i;
-char    temp[9];
-
-    for(i = 0; i < numDigits; i++)
-        temp[i] = getc(fp);
-    temp[i] = 0;
-    return strtol(temp, NULL, 16);
-}
+/* Timing of the USB calls for --stats */
+typedef struct transferStats{
+    double          *latencies; /* seconds per report transfer */
+    int             numLatencies;
+    int             maxLatencies;
+    unsigned long   bytes;      /* report bytes sent and received */
+    double          openSeconds;    /* opening and reconnecting the device */
+    double          transferSeconds;    /* report transfers, including usbFlush() */
+    double          seconds;    /* from opening the device to the end of the upload */
+    int             retries;    /* data sent again and reconnects */
+}transferStats_t;
 
-/* ------------------------------------------------------------------------- */
+static transferStats_t  totalStats; /* of all devices, merged when a job is done */
 
-static int  parseIntelHex(char *hexfile, char buffer[65536 + 256], int *startAddr, int *endAddr)
-{
-int     address, base, d, segment, i, lineLen, sum;
-FILE    *input;
-
-    input = fopen(hexfile, "r");
-    if(input == NULL){
-        fprintf(stderr, "error opening %s: %s\n", hexfile, strerror(errno));
-        return 1;
-    }
-    while(parseUntilColon(input) == ':'){
-        sum = 0;
-        sum += lineLen = parseHex(input, 2);
-        base = address = parseHex(input, 4);
-        sum += address >> 8;
-        sum += address;
-        sum += segment = parseHex(input, 2);  /* segment value? */
-        if(segment != 0)    /* ignore lines where this byte is not 0 */
-            continue;
-        for(i = 0; i < lineLen ; i++){
-            d = parseHex(input, 2);
-            buffer[address++] = d;
-            sum += d;
-        }
-        sum += parseHex(input, 2);
-        if((sum & 0xff) != 0){
-            fprintf(stderr, "Warning: Checksum error between address 0x%x and 0x%x\n", base, address);
-        }
-        if(*startAddr > base)
-            *startAddr = base;
-        if(*endAddr < address)
-            *endAddr = address;
-    }
-    fclose(input);
-    return 0;
-}
+/* State of one device while it is flashed, possibly in a thread of its own */
+typedef struct flashJob{
+    char            location[USB_LOCATION_LEN]; /* empty if the slot is free */
+    image_t         *image;     /* shared read-only by all jobs */
+    usbDevice_t     *dev;
+    int             err;
+    int             blocksSent;
+    int             blocksSkipped;
+    int             resumes;    /* reconnects after failed transfers */
+    double          seconds;
+    double          exitTime;   /* wallClock() when the exit request returned */
+    transferStats_t stats;
+    char            threaded;
+    volatile char   done;       /* set by the thread when finished */
+#if defined(WIN32)
+    HANDLE          thread;
+#else
+    pthread_t       thread;
+#endif
+}flashJob_t;
 
 /* ------------------------------------------------------------------------- */
 
+/* Unknown codes are formatted into a buffer of the calling thread, so this
+ * may be used from several threads. Details are available from
+ * usbLastError().
+ */
 char    *usbErrorMessage(int errCode)
 {
-static char buffer[80];
+static __thread char    buffer[80];
 
     switch(errCode){
         case USB_ERROR_ACCESS:      return "Access to device denied";
@@ -105,6 +117,29 @@ static char buffer[80];
     return NULL;    /* not reached */
 }
 
+/* Prints an error of a USB operation together with the details reported by
+ * the USB layer. If several devices are flashed, the port is prepended.
+ */
+static void printError(flashJob_t *job, char *what, int err)
+{
+char    *detail = job->dev != NULL ? usbLastError(job->dev) : "";
+
+    fprintf(stderr, "%s%s%s: %s%s%s%s\n", job->location, job->location[0] ? ": " : "", what, usbErrorMessage(err),
+            detail[0] ? " (" : "", detail, detail[0] ? ")" : "");
+}
+
+/* Prints progress information unless several devices are flashed at once. */
+static void message(char *format, ...)
+{
+va_list args;
+
+    if(quiet)
+        return;
+    va_start(args, format);
+    vprintf(format, args);
+    va_end(args);
+}
+
 static int  getUsbInt(char *buffer, int numBytes)
 {
 int shift = 0, value = 0, i;
@@ -127,132 +162,1513 @@ int i;
     }
 }
 
+static double   wallClock(void)
+{
+#if defined(WIN32)
+    return GetTickCount() / 1000.0;
+#else
+struct timeval  tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+#endif
+}
+
+/* Waits for a device change until 'deadline' (0 for no deadline), but at
+ * most 'maxMs' milliseconds if that is not negative. Returns non-zero if the
+ * deadline has passed.
+ */
+static int  waitForChange(double deadline, int maxMs)
+{
+double  now = wallClock();
+int     timeoutMs = -1;
+
+    if(deadline != 0 && now >= deadline)
+        return 1;
+    if(deadline != 0)
+        timeoutMs = (int)((deadline - now) * 1000);
+    if(maxMs >= 0 && (timeoutMs < 0 || timeoutMs > maxMs))
+        timeoutMs = maxMs;
+    usbWaitForChange(IDENT_VENDOR_NUM, IDENT_PRODUCT_NUM, timeoutMs);
+    return 0;
+}
+
+/* ------------------------------------------------------------------------- */
+
+/* Unlike wallClock(), this is not affected by changes of the system time. */
+static double   monotonicClock(void)
+{
+#if defined(WIN32)
+LARGE_INTEGER   count, frequency;
+
+    QueryPerformanceCounter(&count);
+    QueryPerformanceFrequency(&frequency);
+    return (double)count.QuadPart / frequency.QuadPart;
+#else
+struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+#endif
+}
+
+static int  addLatencies(transferStats_t *stats, double *latencies, int count)
+{
+double  *p;
+int     n = stats->maxLatencies > 0 ? stats->maxLatencies : 1024;
+
+    while(n < stats->numLatencies + count)
+        n *= 2;
+    if(n > stats->maxLatencies){
+        if((p = realloc(stats->latencies, n * sizeof(*p))) == NULL)
+            return 1;   /* statistics are incomplete, the upload goes on */
+        stats->latencies = p;
+        stats->maxLatencies = n;
+    }
+    memcpy(stats->latencies + stats->numLatencies, latencies, count * sizeof(*latencies));
+    stats->numLatencies += count;
+    return 0;
+}
+
+/* Records a report transfer of 'len' bytes which started at 'start'. */
+static void statsTransfer(transferStats_t *stats, double start, int len, int err)
+{
+double  latency;
+
+    if(!statsFormat)
+        return;
+    latency = monotonicClock() - start;
+    stats->transferSeconds += latency;
+    addLatencies(stats, &latency, 1);
+    if(err == 0)
+        stats->bytes += len;
+}
+
+/* Adds the statistics of a finished job to 'total' and frees them. */
+static void statsMerge(transferStats_t *total, transferStats_t *stats)
+{
+    addLatencies(total, stats->latencies, stats->numLatencies);
+    total->bytes += stats->bytes;
+    total->openSeconds += stats->openSeconds;
+    total->transferSeconds += stats->transferSeconds;
+    total->seconds += stats->seconds;
+    total->retries += stats->retries;
+    free(stats->latencies);
+    memset(stats, 0, sizeof(*stats));
+}
+
+static int  compareLatencies(const void *a, const void *b)
+{
+double  d = *(double *)a - *(double *)b;
+
+    return d < 0 ? -1 : d > 0;
+}
+
+/* Returns the latency in ms below which 'percent' of the transfers are.
+ * The latencies must be sorted.
+ */
+static double   percentile(transferStats_t *stats, int percent)
+{
+int i = (stats->numLatencies * percent + 99) / 100 - 1;
+
+    if(stats->numLatencies == 0)
+        return 0;
+    return stats->latencies[i < 0 ? 0 : i] * 1000;
+}
+
+#define HISTOGRAM_BUCKETS   14  /* from below 0.125 ms, doubling, to 1 s and above */
+#define HISTOGRAM_FIRST_MS  0.125
+
+/* Prints the statistics of all devices, for which 'seconds' is the sum of the
+ * upload times. With several devices, the rate is the average per device.
+ * JSON is printed in one line, so that scripts can take the last line.
+ */
+static void printStats(transferStats_t *stats)
+{
+int     histogram[HISTOGRAM_BUCKETS], i, j, first = -1, last = -1;
+double  limit, rate = stats->seconds > 0 ? stats->bytes / stats->seconds : 0;
+
+    qsort(stats->latencies, stats->numLatencies, sizeof(*stats->latencies), compareLatencies);
+    memset(histogram, 0, sizeof(histogram));
+    for(i = j = 0, limit = HISTOGRAM_FIRST_MS; i < stats->numLatencies; i++){
+        while(j < HISTOGRAM_BUCKETS - 1 && stats->latencies[i] * 1000 >= limit){
+            j++;
+            limit *= 2;
+        }
+        histogram[j]++;
+        if(first < 0)
+            first = j;
+        last = j;
+    }
+    if(statsFormat == STATS_JSON){
+        printf("{\"reports\": %d, \"bytes\": %lu, \"seconds\": %.6f, \"bytesPerSecond\": %.0f, ", stats->numLatencies, stats->bytes, stats->seconds, rate);
+        printf("\"openSeconds\": %.6f, \"transferSeconds\": %.6f, \"retries\": %d, ", stats->openSeconds, stats->transferSeconds, stats->retries);
+        printf("\"latencyMs\": {\"p50\": %.3f, \"p95\": %.3f, \"p99\": %.3f, \"max\": %.3f}, ", percentile(stats, 50), percentile(stats, 95),
+                percentile(stats, 99), percentile(stats, 100));
+        printf("\"histogram\": [");
+        for(i = 0, limit = HISTOGRAM_FIRST_MS; i < HISTOGRAM_BUCKETS; i++, limit *= 2){
+            if(i == HISTOGRAM_BUCKETS - 1){
+                printf("{\"belowMs\": null, \"count\": %d}", histogram[i]);
+            }else{
+                printf("{\"belowMs\": %g, \"count\": %d}, ", limit, histogram[i]);
+            }
+        }
+        printf("]}\n");
+        return;
+    }
+    printf("Statistics:\n");
+    printf("  total bytes ... %lu in %d reports, %.0f bytes/s\n", stats->bytes, stats->numLatencies, rate);
+    printf("  time .......... %.3f s opening the device, %.3f s in transfers, %.3f s total\n", stats->openSeconds, stats->transferSeconds, stats->seconds);
+    printf("  latency ....... p50 %.3f ms, p95 %.3f ms, p99 %.3f ms, max %.3f ms\n", percentile(stats, 50), percentile(stats, 95),
+            percentile(stats, 99), percentile(stats, 100));
+    printf("  retries ....... %d\n", stats->retries);
+    for(i = 0, limit = HISTOGRAM_FIRST_MS; i < HISTOGRAM_BUCKETS; i++, limit *= 2){
+        if(i < first || i > last)
+            continue;
+        if(i == HISTOGRAM_BUCKETS - 1){
+            printf("  >= %8g ms  %d\n", limit / 2, histogram[i]);
+        }else{
+            printf("  <  %8g ms  %d\n", limit, histogram[i]);
+        }
+    }
+}
+
+/* The USB calls of a job, timed for --stats. All reports of the boot loader
+ * are feature reports. Data reports which are queued are timed until they
+ * are queued, the wait for the queue is part of flushReports().
+ */
+static int  openDevice(flashJob_t *job, char *location)
+{
+double  start = monotonicClock();
+int     err;
+
+    err = usbOpenDeviceAt(&job->dev, IDENT_VENDOR_NUM, IDENT_VENDOR_STRING, IDENT_PRODUCT_NUM, IDENT_PRODUCT_STRING, 1, location, deviceSerial);
+    job->stats.openSeconds += monotonicClock() - start;
+    return err;
+}
+
+static int  setReport(flashJob_t *job, char *buffer, int len)
+{
+double  start = monotonicClock();
+int     err = usbSetReport(job->dev, USB_HID_REPORT_TYPE_FEATURE, buffer, len);
+
+    statsTransfer(&job->stats, start, len, err);
+    return err;
+}
+
+static int  setReportAsync(flashJob_t *job, char *buffer, int len)
+{
+double  start = monotonicClock();
+int     err = usbSetReportAsync(job->dev, USB_HID_REPORT_TYPE_FEATURE, buffer, len);
+
+    statsTransfer(&job->stats, start, len, err);
+    return err;
+}
+
+static int  getReport(flashJob_t *job, int reportId, char *buffer, int *len)
+{
+double  start = monotonicClock();
+int     err = usbGetReport(job->dev, USB_HID_REPORT_TYPE_FEATURE, reportId, buffer, len);
+
+    statsTransfer(&job->stats, start, *len, err);
+    return err;
+}
+
+static int  flushReports(flashJob_t *job)
+{
+double  start = monotonicClock();
+int     err = usbFlush(job->dev);
+
+    job->stats.transferSeconds += monotonicClock() - start;
+    return err;
+}
+
 /* ------------------------------------------------------------------------- */
 
+#define FEATURE_ERASE   0x01    /* device can erase the application section */
+#define FEATURE_CRC     0x02    /* device reports CRCs of flash blocks */
+#define FEATURE_READ    0x04    /* device can read back flash blocks */
+#define FEATURE_STATUS  0x08    /* device programs in the background, reports status */
+#define FEATURE_CHECK   0x10    /* device reports pages received with CRC errors */
+#define FEATURE_APP_CHECK   0x20    /* device checks the application trailer */
+#define FEATURE_EEPROM  0x40    /* device can write EEPROM */
+#define FEATURE_SIGNATURE   0x80    /* device reports signature, fuses and lock bits */
+
+#define STATUS_BUSY     0x01    /* pages are waiting to be programmed */
+#define STATUS_FAILED   0x02    /* data was corrupted, must be sent again */
+#define STATUS_EEPROM_BUSY  0x04    /* EEPROM bytes are waiting to be written */
+#define STATUS_EEPROM_FAILED    0x08    /* EEPROM block was corrupted, send again */
+
+#define MAX_RETRIES     3       /* resend attempts after corrupted transfers */
+#define MAX_RESUMES     3       /* reconnects per device after failed transfers */
+#define RECONNECT_TIMEOUT   5   /* seconds to wait for the device to reappear */
+#define ERASE_TIMEOUT   30000   /* ms for devices which erase during the request */
+
+#define CRC_BLOCKS      16      /* number of block CRCs in one CRC report */
+#define LONG_BLOCK_SIZE 512     /* data bytes in the large data report */
+#define EEPROM_BLOCK_SIZE   64  /* data bytes in the EEPROM report */
+
+/* The application trailer occupies the last bytes below the boot loader:
+ * length of the application (4 bytes), CRC16 of this many bytes from address
+ * 0 (2 bytes) and APP_TRAILER_MAGIC (2 bytes).
+ */
+#define APP_TRAILER_SIZE    8
+#define APP_TRAILER_MAGIC   0x4842
+
 typedef struct deviceInfo{
     char    reportId;
     char    pageSize[2];
     char    flashSize[4];
+    char    features;       /* not sent by old boot loaders */
+    char    protocolVersion;    /* this and the following fields are */
+    char    bootloaderAddress[4];   /* not sent before protocol version 1 */
+    char    maxBlockSize[2];
+    char    usbdrvVersion[4];
+    char    eepromSize[2];  /* not sent before protocol version 5 */
 }deviceInfo_t;
 
+/* What we know about the boot loader, derived from the device info report */
+typedef struct deviceCaps{
+    int     pageSize;
+    int     deviceSize;
+    int     bootloaderAddress;  /* end of the application section */
+    int     maxBlockSize;       /* data bytes per data report */
+    int     protocolVersion;
+    long    usbdrvVersion;      /* 0 if unknown */
+    int     features;
+    int     eepromSize;         /* 0 if unknown */
+}deviceCaps_t;
+
+#define BOOTLOADER_SIZE_DEFAULT 2048    /* if the device doesn't tell us */
+
 typedef struct deviceData{
+    char    reportId;       /* 2, or 7 for the large data report */
+    char    address[3];
+    char    data[LONG_BLOCK_SIZE];  /* only 128 bytes are sent in report 2 */
+}deviceData_t;
+
+typedef struct deviceErase{
+    char    reportId;
+    char    reserved;
+}deviceErase_t;
+
+typedef struct deviceAddress{
+    char    reportId;
+    char    address[3];
+}deviceAddress_t;
+
+typedef struct deviceCrc{
+    char    reportId;
+    char    address[3];
+    char    crc[CRC_BLOCKS][2];
+}deviceCrc_t;
+
+typedef struct deviceRead{
     char    reportId;
     char    address[3];
     char    data[128];
-}deviceData_t;
+}deviceRead_t;
+
+typedef struct deviceStatus{
+    char    reportId;
+    char    flags;
+    char    address[3];     /* end of the last page written */
+    char    pagesWritten[2];
+    char    pagesSkipped[2];    /* equal to flash, not sent before protocol 3 */
+    char    failedAddress[3];   /* first corrupted data, not sent before protocol 4 */
+    char    pagesFailed[2];
+    char    eepromWritten[2];   /* not sent before protocol 5 */
+}deviceStatus_t;
+
+typedef struct deviceEeprom{
+    char    reportId;
+    char    address[3];
+    char    length;         /* valid bytes in 'data' */
+    char    data[EEPROM_BLOCK_SIZE];
+}deviceEeprom_t;
+
+typedef struct deviceSignature{
+    char    reportId;
+    char    signature[3];
+    char    lowFuse;
+    char    highFuse;
+    char    extendedFuse;
+    char    lockBits;
+}deviceSignature_t;
+
+#define LOCK_BLB0_MASK  0x0c    /* boot lock bits for the application section */
+
+typedef struct crcCache{
+    int         base;   /* address of the first block in 'report', -1 if empty */
+    deviceCrc_t report;
+}crcCache_t;
+
+/* Compares the blocks between 'address' and 'endAddr' with the CRCs reported
+ * by the device. CRCs are read in groups of CRC_BLOCKS blocks and cached.
+ * '*unchanged' is set to non-zero if all blocks match.
+ */
+static int  compareCrc(flashJob_t *job, image_t *image, crcCache_t *cache, int address, int endAddr, int *unchanged)
+{
+deviceAddress_t setAddress;
+int             err, len, i;
+
+    *unchanged = 1;
+    for(; address < endAddr; address += IMAGE_BLOCK_SIZE){
+        if(cache->base < 0 || address < cache->base || address >= cache->base + CRC_BLOCKS * IMAGE_BLOCK_SIZE){
+            cache->base = -1;
+            setAddress.reportId = 4;
+            setUsbInt(setAddress.address, address, 3);
+            if((err = setReport(job, (char *)&setAddress, sizeof(setAddress))) != 0)
+                return err;
+            len = sizeof(cache->report);
+            if((err = getReport(job, 5, (char *)&cache->report, &len)) != 0)
+                return err;
+            if(getUsbInt(cache->report.address, 3) != address){
+                fprintf(stderr, "CRC report for wrong address 0x%x\n", getUsbInt(cache->report.address, 3));
+                return USB_ERROR_IO;
+            }
+            cache->base = address;
+        }
+        i = (address - cache->base) / IMAGE_BLOCK_SIZE;
+        if(getUsbInt(cache->report.crc[i], 2) != imageBlockCrc(image, address)){
+            *unchanged = 0;
+            break;
+        }
+    }
+    return 0;
+}
+
+/* Returns non-zero if all bytes between 'address' and 'endAddr' are 0xff. */
+static int  isBlank(image_t *image, int address, int endAddr)
+{
+unsigned char   *block;
+int             i;
+
+    for(; address < endAddr; address += IMAGE_BLOCK_SIZE){
+        if((block = imageBlock(image, address)) == NULL)
+            continue;
+        for(i = 0; i < IMAGE_BLOCK_SIZE; i++){
+            if(block[i] != 0xff)
+                return 0;
+        }
+    }
+    return 1;
+}
+
+/* Reads back all pages which contain data and compares them with the image.
+ * Mismatching pages are listed, '*errors' is set to their number.
+ */
+static int  verifyData(flashJob_t *job, image_t *image, int mask, int *errors)
+{
+deviceAddress_t setAddress;
+deviceRead_t    readBack;
+unsigned char   *block;
+int             err, len, address, pageEnd, readAddress = -1, pageOk, i;
+
+    *errors = 0;
+    for(address = imageNextBlock(image, 0); address >= 0; address = imageNextBlock(image, pageEnd)){
+        address &= ~mask;   /* round down to page start */
+        pageEnd = address + mask + 1;
+        pageOk = 1;
+        for(; address < pageEnd; address += sizeof(readBack.data)){
+            if(address != readAddress){ /* the device advances the address itself */
+                setAddress.reportId = 4;
+                setUsbInt(setAddress.address, address, 3);
+                if((err = setReport(job, (char *)&setAddress, sizeof(setAddress))) != 0)
+                    return err;
+            }
+            len = sizeof(readBack);
+            if((err = getReport(job, 6, (char *)&readBack, &len)) != 0)
+                return err;
+            if(getUsbInt(readBack.address, 3) != address){
+                fprintf(stderr, "Read back report for wrong address 0x%x\n", getUsbInt(readBack.address, 3));
+                return USB_ERROR_IO;
+            }
+            readAddress = address + sizeof(readBack.data);
+            message("\r0x%05x ... 0x%05x", address, readAddress);
+            fflush(stdout);
+            block = imageBlock(image, address);
+            for(i = 0; i < (int)sizeof(readBack.data); i++){
+                if((readBack.data[i] & 0xff) != (block != NULL ? block[i] : 0xff))
+                    pageOk = 0;
+            }
+        }
+        if(!pageOk){
+            message("\rVerify error in page 0x%05x ... 0x%05x\n", pageEnd - mask - 1, pageEnd);
+            (*errors)++;
+        }
+    }
+    message("\n");
+    return 0;
+}
+
+/* Reads the device info report once and fills in 'caps'. Fields which old
+ * boot loaders don't send get the values these boot loaders imply.
+ */
+static int  readDeviceInfo(flashJob_t *job, deviceCaps_t *caps)
+{
+deviceInfo_t    info;
+int             err, len = sizeof(info);
+
+    memset(&info, 0, sizeof(info));
+    if((err = getReport(job, 1, (char *)&info, &len)) != 0){
+        printError(job, "Error reading page size", err);
+        return err;
+    }
+    if(len < (int)offsetof(deviceInfo_t, features)){
+        fprintf(stderr, "Not enough bytes in device info report (%d instead of %d)\n", len, (int)offsetof(deviceInfo_t, features));
+        return -1;
+    }
+    caps->pageSize = getUsbInt(info.pageSize, 2);
+    caps->deviceSize = getUsbInt(info.flashSize, 4);
+    caps->features = len > (int)offsetof(deviceInfo_t, features) ? info.features & 0xff : 0;
+    caps->bootloaderAddress = caps->deviceSize - BOOTLOADER_SIZE_DEFAULT;
+    caps->maxBlockSize = 128;
+    caps->protocolVersion = 0;
+    caps->usbdrvVersion = 0;
+    caps->eepromSize = 0;
+    if(len >= (int)offsetof(deviceInfo_t, eepromSize)){
+        caps->protocolVersion = info.protocolVersion & 0xff;
+        caps->bootloaderAddress = getUsbInt(info.bootloaderAddress, 4);
+        caps->maxBlockSize = getUsbInt(info.maxBlockSize, 2);
+        caps->usbdrvVersion = (unsigned)getUsbInt(info.usbdrvVersion, 4);
+        if(caps->bootloaderAddress <= 0 || caps->bootloaderAddress > caps->deviceSize){
+            fprintf(stderr, "Invalid boot loader address 0x%x in device info report\n", caps->bootloaderAddress);
+            return -1;
+        }
+        if(caps->pageSize <= 0 || LONG_BLOCK_SIZE % caps->pageSize != 0)
+            caps->maxBlockSize = IMAGE_BLOCK_SIZE;  /* large reports must hold whole pages */
+    }
+    if(len >= (int)sizeof(info))
+        caps->eepromSize = getUsbInt(info.eepromSize, 2);
+    return 0;
+}
+
+/* Devices which may run this boot loader and their signature bytes */
+static struct mcuInfo{
+    char    *name;
+    int     signature;
+}mcuTable[] = {
+    {"atmega8",     0x1e9307},
+    {"atmega8515",  0x1e9306},
+    {"atmega8535",  0x1e9308},
+    {"atmega88",    0x1e930a},
+    {"atmega88p",   0x1e930f},
+    {"atmega16",    0x1e9403},
+    {"atmega162",   0x1e9404},
+    {"atmega164p",  0x1e940a},
+    {"atmega168",   0x1e9406},
+    {"atmega168p",  0x1e940b},
+    {"atmega32",    0x1e9502},
+    {"atmega324p",  0x1e9508},
+    {"atmega328",   0x1e9514},
+    {"atmega328p",  0x1e950f},
+    {"atmega64",    0x1e9602},
+    {"atmega644",   0x1e9609},
+    {"atmega644p",  0x1e960a},
+    {"atmega128",   0x1e9702},
+    {"atmega1280",  0x1e9703},
+    {"atmega1284p", 0x1e9705},
+    {"atmega2560",  0x1e9801},
+    {NULL, 0}
+};
+
+static char *mcuName(int signature)
+{
+struct mcuInfo  *mcu;
+
+    for(mcu = mcuTable; mcu->name != NULL; mcu++){
+        if(mcu->signature == signature)
+            return mcu->name;
+    }
+    return "unknown MCU";
+}
+
+/* Accepts a name from mcuTable or the signature as 6 hex digits. Returns -1
+ * if the MCU is not known.
+ */
+static int  mcuSignature(char *name)
+{
+struct mcuInfo  *mcu;
+char            *end;
+long            signature;
+
+    for(mcu = mcuTable; mcu->name != NULL; mcu++){
+        if(strcmp(mcu->name, name) == 0)
+            return mcu->signature;
+    }
+    signature = strtol(name, &end, 16);
+    if(*end != 0 || strlen(name) < 6 || signature <= 0 || signature > 0xffffff)
+        return -1;
+    return signature;
+}
+
+/* Reads signature, fuses and lock bits and checks them before any data is
+ * sent: the signature must match --mcu, and the lock bits must allow the boot
+ * loader to write and read the application section.
+ */
+static int  checkSignature(flashJob_t *job, deviceCaps_t *caps)
+{
+deviceSignature_t   report;
+int                 err, len = sizeof(report), signature;
+
+    if(!(caps->features & FEATURE_SIGNATURE)){
+        if(targetSignature < 0)
+            return 0;
+        fprintf(stderr, "Device does not report its signature, cannot check for %s!\n", mcuName(targetSignature));
+        return -1;
+    }
+    memset(&report, 0, sizeof(report));
+    if((err = getReport(job, 10, (char *)&report, &len)) != 0){
+        printError(job, "Error reading signature", err);
+        return err;
+    }
+    if(len < (int)sizeof(report)){
+        fprintf(stderr, "Not enough bytes in signature report (%d instead of %d)\n", len, (int)sizeof(report));
+        return -1;
+    }
+    signature = (report.signature[0] & 0xff) << 16 | (report.signature[1] & 0xff) << 8 | (report.signature[2] & 0xff);
+    message("Signature   = %06x (%s), fuses low 0x%02x high 0x%02x extended 0x%02x, lock bits 0x%02x\n", signature, mcuName(signature),
+            report.lowFuse & 0xff, report.highFuse & 0xff, report.extendedFuse & 0xff, report.lockBits & 0xff);
+    if(targetSignature >= 0 && signature != targetSignature){
+        fprintf(stderr, "Image is for %s (%06x), but device is %s (%06x)!\n", mcuName(targetSignature), targetSignature, mcuName(signature), signature);
+        return -1;
+    }
+    if((report.lockBits & LOCK_BLB0_MASK) != LOCK_BLB0_MASK){
+        fprintf(stderr, "Application section is protected by lock bits 0x%02x!\n", report.lockBits & 0xff);
+        return -1;
+    }
+    return 0;
+}
+
+/* Sends the data between 'address' and 'endAddr', which must be page aligned.
+ * The large data report is used while enough data is left and the device
+ * supports it, the rest is sent in reports of 128 bytes.
+ */
+static int  sendData(flashJob_t *job, image_t *image, deviceCaps_t *caps, int address, int endAddr, int *numBlocks)
+{
+deviceData_t    report;
+unsigned char   *block;
+int             err, blockSize, i;
+
+    while(address < endAddr){
+        if(caps->maxBlockSize >= LONG_BLOCK_SIZE && endAddr - address >= LONG_BLOCK_SIZE){
+            report.reportId = 7;
+            blockSize = LONG_BLOCK_SIZE;
+        }else{
+            report.reportId = 2;
+            blockSize = IMAGE_BLOCK_SIZE;
+        }
+        setUsbInt(report.address, address, 3);
+        for(i = 0; i < blockSize; i += IMAGE_BLOCK_SIZE){
+            if((block = imageBlock(image, address + i)) != NULL){
+                memcpy(report.data + i, block, IMAGE_BLOCK_SIZE);
+            }else{
+                memset(report.data + i, -1, IMAGE_BLOCK_SIZE);
+            }
+        }
+        message("\r0x%05x ... 0x%05x", address, address + blockSize);
+        fflush(stdout);
+        /* Data reports are queued if the USB implementation supports it, so
+         * the next block is waiting while this one is sent.
+         */
+        if((err = setReportAsync(job, (char *)&report, offsetof(deviceData_t, data) + blockSize)) != 0){
+            printError(job, "Error uploading data block", err);
+            return err;
+        }
+        address += blockSize;
+        *numBlocks += blockSize / IMAGE_BLOCK_SIZE;
+    }
+    return 0;
+}
+
+/* Returns the first page at or above 'address' which must be considered for
+ * upload, or -1 if there is none. With 'fillGaps', these are all pages up to
+ * the end of the image, otherwise only pages which contain data.
+ */
+static int  nextPage(image_t *image, int address, int fillGaps)
+{
+    if(!fillGaps)
+        return imageNextBlock(image, address);
+    return address < image->endAddr ? address : -1;
+}
+
+/* Sends all pages from 'startAddr' up to 'endAddr' which contain data, or all
+ * of them if 'fillGaps' is set. A page is always sent as a whole because the
+ * device writes it when the last block arrives. After a device side erase
+ * ('didErase'), pages containing only 0xff are skipped. If 'crcCache' is
+ * given, pages which match the CRCs reported by the device are skipped.
+ */
+static int  sendImage(flashJob_t *job, image_t *image, deviceCaps_t *caps, int mask, int startAddr, int endAddr, int fillGaps,
+                      int didErase, crcCache_t *crcCache, int *numBlocks)
+{
+int err, address, pageEnd, unchanged, runStart = 0, runEnd = 0;
+
+    for(address = nextPage(image, startAddr, fillGaps); address >= 0 && address < endAddr; address = nextPage(image, pageEnd, fillGaps)){
+        address &= ~mask;   /* round down to page start */
+        pageEnd = address + mask + 1;
+        if(didErase && isBlank(image, address, pageEnd))
+            continue;
+        if(crcCache != NULL){
+            if((err = compareCrc(job, image, crcCache, address, pageEnd, &unchanged)) != 0){
+                printError(job, "Error reading flash CRC", err);
+                return err;
+            }
+            if(unchanged)
+                continue;
+        }
+        /* consecutive pages are collected so that large reports fit */
+        if(address != runEnd){
+            if((err = sendData(job, image, caps, runStart, runEnd, numBlocks)) != 0)
+                return err;
+            runStart = address;
+        }
+        runEnd = pageEnd;
+    }
+    if((err = sendData(job, image, caps, runStart, runEnd, numBlocks)) != 0)
+        return err;
+    if((err = flushReports(job)) != 0){
+        printError(job, "Error uploading data block", err);
+        return err;
+    }
+    return 0;
+}
+
+/* Builds an image of the page which holds the application trailer. Data of
+ * 'image' in this page is copied, the trailer describes all of 'image'.
+ * Returns NULL if out of memory.
+ */
+static image_t  *makeTrailer(image_t *image, int trailerAddr, int mask)
+{
+image_t         *trailer;
+unsigned char   *block;
+char            bytes[APP_TRAILER_SIZE];
+int             address;
+
+    if((trailer = imageNew()) == NULL)
+        return NULL;
+    for(address = trailerAddr & ~mask; address < trailerAddr; address += IMAGE_BLOCK_SIZE){
+        if((block = imageBlock(image, address)) != NULL && imageWrite(trailer, address, block, IMAGE_BLOCK_SIZE) != 0)
+            goto outOfMemory;
+    }
+    setUsbInt(bytes, image->endAddr, 4);
+    setUsbInt(bytes + 4, imageCrc(image, 0, image->endAddr), 2);
+    setUsbInt(bytes + 6, APP_TRAILER_MAGIC, 2);
+    if(imageWrite(trailer, trailerAddr, (unsigned char *)bytes, sizeof(bytes)) == 0)
+        return trailer;
+outOfMemory:
+    imageFree(trailer);
+    return NULL;
+}
+
+/* Sends the image from 'startAddr' on. If a 'trailer' is given, the gaps in
+ * the image are sent as 0xff so that the flash matches the CRC in the trailer,
+ * and the page holding the trailer is sent last.
+ */
+static int  sendUpload(flashJob_t *job, image_t *image, image_t *trailer, deviceCaps_t *caps, int mask, int startAddr,
+                       int didErase, crcCache_t *crcCache, int *numBlocks)
+{
+int err, trailerPage;
+
+    if(trailer == NULL)
+        return sendImage(job, image, caps, mask, startAddr, image->endAddr, 0, didErase, crcCache, numBlocks);
+    trailerPage = trailer->startAddr & ~mask;
+    if((err = sendImage(job, image, caps, mask, startAddr, trailerPage, 1, didErase, crcCache, numBlocks)) != 0)
+        return err;
+    return sendImage(job, trailer, caps, mask, startAddr, trailer->endAddr, 0, didErase, crcCache, numBlocks);
+}
+
+/* Reads the status report. If 'wait' is set, polls until all pages are
+ * programmed.
+ */
+static int  readStatus(flashJob_t *job, deviceStatus_t *status, int wait)
+{
+int err, len;
+
+    memset(status, 0, sizeof(*status));
+    do{
+        len = sizeof(*status);
+        if((err = getReport(job, 8, (char *)status, &len)) != 0){
+            printError(job, "Error reading programming status", err);
+            return err;
+        }
+        if(len < (int)offsetof(deviceStatus_t, pagesSkipped)){
+            fprintf(stderr, "Not enough bytes in status report (%d instead of %d)\n", len, (int)sizeof(*status));
+            return -1;
+        }
+    }while(wait && (status->flags & STATUS_BUSY));
+    return 0;
+}
+
+/* Opens the device again after a transfer failed, at the same port or with
+ * the same serial number as before. The device may re-enumerate meanwhile,
+ * this time counts as open time in the statistics.
+ */
+static int  reconnectDevice(flashJob_t *job)
+{
+double  deadline = wallClock() + RECONNECT_TIMEOUT, start = monotonicClock(), openSeconds = job->stats.openSeconds;
+char    *location = job->location[0] ? job->location : numDeviceLocations > 0 ? deviceLocations[0] : NULL;
+int     err;
+
+    usbCloseDevice(job->dev);
+    job->dev = NULL;
+    /* Until udev has set the permissions of the new device node, opening it
+     * may fail with USB_ERROR_ACCESS or USB_ERROR_IO. We poll then because
+     * no further event may come.
+     */
+    while((err = openDevice(job, location)) == USB_ERROR_NOTFOUND || err == USB_ERROR_ACCESS || err == USB_ERROR_IO){
+        if(waitForChange(deadline, err == USB_ERROR_NOTFOUND ? -1 : 100))
+            break;
+    }
+    job->stats.openSeconds = openSeconds + monotonicClock() - start;   /* waiting for enumeration included */
+    if(err != 0)
+        printError(job, "Error reopening HIDBoot device", err);
+    return err;
+}
+
+/* Called when a transfer of the upload which started at 'startAddr' failed
+ * with 'err'. Reconnects and returns the address where the upload continues,
+ * or -1 if it can't. If the device reports its status, this is the end of the
+ * last page it has programmed, provided it programmed pages since our last
+ * look at '*pagesDone'. Otherwise we start over, the CRC comparison skips the
+ * pages which are already done.
+ */
+static int  resumeUpload(flashJob_t *job, deviceCaps_t *caps, int err, int startAddr, int *pagesDone)
+{
+deviceStatus_t  status;
+int             done, address;
+
+    while(err == USB_ERROR_IO && job->resumes < MAX_RESUMES){
+        job->resumes++;
+        job->stats.retries++;
+        message("\nTransfer failed, reconnecting (%d of %d)\n", job->resumes, MAX_RESUMES);
+        if((err = reconnectDevice(job)) != 0)
+            continue;
+        if(!(caps->features & FEATURE_STATUS))
+            return startAddr;
+        if((err = readStatus(job, &status, 1)) != 0)
+            continue;
+        done = getUsbInt(status.pagesWritten, 2) + getUsbInt(status.pagesSkipped, 2) + getUsbInt(status.pagesFailed, 2);
+        address = getUsbInt(status.address, 3);
+        if(((done - *pagesDone) & 0xffff) == 0 || address <= startAddr || address > caps->bootloaderAddress)
+            address = startAddr;   /* nothing programmed, or the device was reset */
+        *pagesDone = done;
+        message("Resuming upload at 0x%05x\n", address);
+        return address;
+    }
+    return -1;
+}
+
+/* Sends the EEPROM image in blocks of EEPROM_BLOCK_SIZE bytes. The device
+ * writes them from its main loop, we poll the status report until a block is
+ * done before we send the next one. Corrupted blocks are sent again. Bytes
+ * outside of the file's address range and image blocks without data are left
+ * alone. Other gaps are sent as 0xff since we cannot read the EEPROM back.
+ */
+static int  uploadEeprom(flashJob_t *job, image_t *eeprom, deviceCaps_t *caps)
+{
+deviceEeprom_t  report;
+deviceStatus_t  status;
+unsigned char   *block;
+int             err, address, len, numBytes = 0, written, retries = 0;
+
+    if(!(caps->features & FEATURE_EEPROM) || !(caps->features & FEATURE_STATUS)){
+        fprintf(stderr, "Device does not support writing EEPROM!\n");
+        return -1;
+    }
+    if(eeprom->endAddr > caps->eepromSize){
+        fprintf(stderr, "EEPROM data (%d bytes) exceeds EEPROM size (%d bytes)!\n", eeprom->endAddr, caps->eepromSize);
+        return -1;
+    }
+    if((err = readStatus(job, &status, 0)) != 0)
+        return err;
+    written = getUsbInt(status.eepromWritten, 2);
+    message("Writing EEPROM between %d (0x%x) and %d (0x%x)\n", eeprom->startAddr, eeprom->startAddr, eeprom->endAddr, eeprom->endAddr);
+    for(address = eeprom->startAddr; address >= 0; ){
+        block = imageBlock(eeprom, address);
+        len = EEPROM_BLOCK_SIZE - address % EEPROM_BLOCK_SIZE;  /* stay within the image block */
+        if(len > eeprom->endAddr - address)
+            len = eeprom->endAddr - address;
+        report.reportId = 9;
+        setUsbInt(report.address, address, 3);
+        report.length = len;
+        memset(report.data, -1, sizeof(report.data));
+        memcpy(report.data, block + address % IMAGE_BLOCK_SIZE, len);
+        message("\r0x%04x ... 0x%04x", address, address + len);
+        fflush(stdout);
+        if((err = setReport(job, (char *)&report, sizeof(report))) != 0){
+            printError(job, "Error writing EEPROM block", err);
+            return err;
+        }
+        do{ /* the device writes a byte in several ms */
+            if((err = readStatus(job, &status, 0)) != 0)
+                return err;
+        }while(status.flags & STATUS_EEPROM_BUSY);
+        if(status.flags & STATUS_EEPROM_FAILED){
+            job->stats.retries++;
+            if(++retries > MAX_RETRIES){
+                fprintf(stderr, "\nEEPROM data still corrupted after %d retries!\n", MAX_RETRIES);
+                return -1;
+            }
+            status.reportId = 8;    /* acknowledge the failure and send again */
+            if((err = setReport(job, (char *)&status, sizeof(status))) != 0){
+                printError(job, "Error resetting programming status", err);
+                return err;
+            }
+            continue;
+        }
+        numBytes += len;
+        address += len;
+        if(address % IMAGE_BLOCK_SIZE == 0 || address >= eeprom->endAddr)
+            address = imageNextBlock(eeprom, address);
+    }
+    written = (getUsbInt(status.eepromWritten, 2) - written) & 0xffff;
+    message("\n%d EEPROM bytes transferred, %d of them changed\n", numBytes, written);
+    return 0;
+}
 
-static int uploadData(char *dataBuffer, int startAddr, int endAddr)
+static int uploadData(flashJob_t *job, image_t *image)
 {
-usbDevice_t *dev = NULL;
-int         err = 0, len, mask, pageSize, deviceSize;
+int             err = 0, mask, numBlocks, rangeBlocks, retryBlocks = 0, retries;
+int             didErase = 0, useCrc = 0, errors, trailerErrors, failedAddress, trailerAddr = 0;
+int             pagesWritten = 0, pagesSkipped = 0, pagesFailed = 0, numPages;
+int             resumeAddr = 0, pagesDone = 0, checkBlocks = 0, done;
+crcCache_t      crcCache;
+image_t         *trailer = NULL;
+deviceCaps_t    caps;
+deviceStatus_t  status;
 union{
     char            bytes[1];
     deviceInfo_t    info;
-    deviceData_t    data;
+    deviceErase_t   erase;
 }           buffer;
 
-    if((err = usbOpenDevice(&dev, IDENT_VENDOR_NUM, IDENT_VENDOR_STRING, IDENT_PRODUCT_NUM, IDENT_PRODUCT_STRING, 1)) != 0){
-        fprintf(stderr, "Error opening HIDBoot device: %s\n", usbErrorMessage(err));
-        goto errorOccurred;
-    }
-    len = sizeof(buffer);
-    if(endAddr > startAddr){    // we need to upload data
-        if((err = usbGetReport(dev, USB_HID_REPORT_TYPE_FEATURE, 1, buffer.bytes, &len)) != 0){
-            fprintf(stderr, "Error reading page size: %s\n", usbErrorMessage(err));
+    memset(&buffer, 0, sizeof(buffer));
+    if(image != NULL || eepromImage != NULL){
+        if((err = readDeviceInfo(job, &caps)) != 0)
             goto errorOccurred;
+        message("Page size   = %d (0x%x)\n", caps.pageSize, caps.pageSize);
+        message("Device size = %d (0x%x); %d bytes remaining\n", caps.deviceSize, caps.deviceSize, caps.bootloaderAddress);
+        if(caps.protocolVersion > 0){
+            message("Boot loader = %d bytes at 0x%x, protocol version %d, V-USB %ld, %d bytes per report\n", caps.deviceSize - caps.bootloaderAddress,
+                    caps.bootloaderAddress, caps.protocolVersion, caps.usbdrvVersion, caps.maxBlockSize);
         }
-        if(len < sizeof(buffer.info)){
-            fprintf(stderr, "Not enough bytes in device info report (%d instead of %d)\n", len, (int)sizeof(buffer.info));
-            err = -1;
+        if((err = checkSignature(job, &caps)) != 0)
             goto errorOccurred;
-        }
-        pageSize = getUsbInt(buffer.info.pageSize, 2);
-        deviceSize = getUsbInt(buffer.info.flashSize, 4);
-        printf("Page size   = %d (0x%x)\n", pageSize, pageSize);
-        printf("Device size = %d (0x%x); %d bytes remaining\n", deviceSize, deviceSize, deviceSize - 2048);
-        if(endAddr > deviceSize - 2048){
-            fprintf(stderr, "Data (%d bytes) exceeds remaining flash size!\n", endAddr);
+    }
+    if(image != NULL){  // we need to upload data
+        if(image->endAddr > caps.bootloaderAddress){
+            fprintf(stderr, "Data (%d bytes) exceeds remaining flash size!\n", image->endAddr);
             err = -1;
             goto errorOccurred;
         }
-        if(pageSize < 128){
+        if(caps.pageSize < 128){
             mask = 127;
         }else{
-            mask = pageSize - 1;
-        }
-        startAddr &= ~mask;                  /* round down */
-        endAddr = (endAddr + mask) & ~mask;  /* round up */
-        printf("Uploading %d (0x%x) bytes starting at %d (0x%x)\n", endAddr - startAddr, endAddr - startAddr, startAddr, startAddr);
-        while(startAddr < endAddr){
-            buffer.data.reportId = 2;
-            memcpy(buffer.data.data, dataBuffer + startAddr, 128);
-            setUsbInt(buffer.data.address, startAddr, 3);
-            printf("\r0x%05x ... 0x%05x", startAddr, startAddr + (int)sizeof(buffer.data.data));
-            fflush(stdout);
-            if((err = usbSetReport(dev, USB_HID_REPORT_TYPE_FEATURE, buffer.bytes, sizeof(buffer.data))) != 0){
-                fprintf(stderr, "Error uploading data block: %s\n", usbErrorMessage(err));
+            mask = caps.pageSize - 1;
+        }
+        if(caps.features & FEATURE_APP_CHECK){
+            /* The boot loader starts the application only if it matches the
+             * trailer, so gaps in the file are programmed with 0xff.
+             */
+            trailerAddr = caps.bootloaderAddress - APP_TRAILER_SIZE;
+            if(image->endAddr > trailerAddr){
+                fprintf(stderr, "Data (%d bytes) overlaps application trailer at 0x%x!\n", image->endAddr, trailerAddr);
+                err = -1;
+                goto errorOccurred;
+            }
+            if((trailer = makeTrailer(image, trailerAddr, mask)) == NULL){
+                fprintf(stderr, "Out of memory\n");
+                err = -1;
+                goto errorOccurred;
+            }
+            message("Application trailer at 0x%x: %d bytes, CRC 0x%04x\n", trailerAddr, image->endAddr, imageCrc(image, 0, image->endAddr));
+        }
+        if(verifyAfterWrite && !(caps.features & FEATURE_READ)){
+            fprintf(stderr, "Device does not support reading back flash, cannot verify!\n");
+            err = -1;
+            goto errorOccurred;
+        }
+        if(caps.features & FEATURE_STATUS){
+            if((err = readStatus(job, &status, 0)) != 0)
+                goto errorOccurred;
+            pagesWritten = getUsbInt(status.pagesWritten, 2);
+            pagesSkipped = getUsbInt(status.pagesSkipped, 2);
+            pagesFailed = getUsbInt(status.pagesFailed, 2);
+            pagesDone = pagesWritten + pagesSkipped + pagesFailed;
+        }
+        if(caps.features & FEATURE_CRC){
+            /* Upload only pages which differ from the flash contents. We must
+             * not erase in this case since unchanged pages are not sent.
+             */
+            message("Comparing with flash contents\n");
+            crcCache.base = -1;
+            useCrc = 1;
+        }else if(caps.features & FEATURE_ERASE){
+            message("Erasing application section\n");
+            buffer.erase.reportId = 3;
+            /* Devices without status report erase before they complete the
+             * request, this takes several seconds with large flash.
+             */
+            usbSetTimeout(job->dev, ERASE_TIMEOUT);
+            err = setReport(job, buffer.bytes, sizeof(buffer.erase));
+            usbSetTimeout(job->dev, USB_DEFAULT_TIMEOUT);
+            if(err != 0){
+                printError(job, "Error erasing flash", err);
+                goto errorOccurred;
+            }
+            /* The others erase in the background and report busy meanwhile. */
+            if((caps.features & FEATURE_STATUS) && (err = readStatus(job, &status, 1)) != 0)
+                goto errorOccurred;
+            didErase = 1;
+        }
+        rangeBlocks = (((image->endAddr + mask) & ~mask) - (image->startAddr & ~mask)) / IMAGE_BLOCK_SIZE;
+        if(trailer != NULL){    /* everything from 0 on plus the trailer page */
+            rangeBlocks = ((image->endAddr + mask) & ~mask) / IMAGE_BLOCK_SIZE;
+            if(image->endAddr <= (trailerAddr & ~mask))
+                rangeBlocks += (mask + 1) / IMAGE_BLOCK_SIZE;
+        }
+        numBlocks = 0;
+        message("Uploading data between %d (0x%x) and %d (0x%x)\n", image->startAddr, image->startAddr, image->endAddr, image->endAddr);
+        /* After a failed transfer, we reconnect and continue with the first
+         * page the device has not programmed.
+         */
+        while((err = sendUpload(job, image, trailer, &caps, mask, resumeAddr, didErase, useCrc ? &crcCache : NULL, &numBlocks)) != 0){
+            if((resumeAddr = resumeUpload(job, &caps, err, resumeAddr, &pagesDone)) < 0)
+                goto errorOccurred;
+            crcCache.base = -1;
+            checkBlocks = numBlocks;    /* pages since the device's count */
+        }
+        if(caps.features & FEATURE_STATUS){
+            /* The device programs the last pages after the transfers are
+             * complete. Wait for it and check that no page got lost. Pages
+             * which arrived corrupted are not programmed, we send them again.
+             * The device reports only the first of them, the CRC comparison
+             * skips the intact pages after it.
+             */
+            for(retries = 0; ; retries++){
+                if((err = readStatus(job, &status, 1)) != 0)
+                    goto errorOccurred;
+                if(!(caps.features & FEATURE_CHECK) || !(status.flags & STATUS_FAILED))
+                    break;
+                if(retries >= MAX_RETRIES){
+                    fprintf(stderr, "Data still corrupted after %d retries!\n", retries);
+                    err = -1;
+                    goto errorOccurred;
+                }
+                job->stats.retries++;
+                failedAddress = getUsbInt(status.failedAddress, 3) & ~mask;
+                message("\nCorrupted data received by device, sending again from 0x%05x\n", failedAddress);
+                status.reportId = 8;    /* acknowledge the failure */
+                if((err = setReport(job, (char *)&status, sizeof(status))) != 0){
+                    printError(job, "Error resetting programming status", err);
+                    goto errorOccurred;
+                }
+                crcCache.base = -1;     /* the pages from failedAddress on have changed */
+                if((err = sendUpload(job, image, trailer, &caps, mask, failedAddress, didErase, useCrc ? &crcCache : NULL, &retryBlocks)) != 0)
+                    goto errorOccurred;
+            }
+            pagesWritten = (getUsbInt(status.pagesWritten, 2) - pagesWritten) & 0xffff;
+            pagesSkipped = (getUsbInt(status.pagesSkipped, 2) - pagesSkipped) & 0xffff;
+            pagesFailed = (getUsbInt(status.pagesFailed, 2) - pagesFailed) & 0xffff;
+            numPages = (numBlocks - checkBlocks + retryBlocks) * IMAGE_BLOCK_SIZE / caps.pageSize;
+            done = (getUsbInt(status.pagesWritten, 2) + getUsbInt(status.pagesSkipped, 2) + getUsbInt(status.pagesFailed, 2) - pagesDone) & 0xffff;
+            if(done != numPages){
+                fprintf(stderr, "Device programmed %d pages instead of %d!\n", done, numPages);
+                err = -1;
                 goto errorOccurred;
             }
-            startAddr += sizeof(buffer.data.data);
         }
-        printf("\n");
+        job->blocksSent = numBlocks;
+        job->blocksSkipped = rangeBlocks > numBlocks ? rangeBlocks - numBlocks : 0;  /* blocks may be sent twice after a reconnect */
+        message("\n%d blocks of %d bytes transferred, %d blocks in range skipped\n", numBlocks, IMAGE_BLOCK_SIZE, job->blocksSkipped);
+        if(job->resumes > 0)
+            message("Upload resumed after %d failed transfer(s)\n", job->resumes);
+        if(retryBlocks > 0)
+            message("%d blocks sent again after %d corrupted page(s)\n", retryBlocks, pagesFailed);
+        if(pagesSkipped > 0)
+            message("%d pages were equal to the flash contents and not programmed\n", pagesSkipped);
+        if(verifyAfterWrite){
+            message("Verifying\n");
+            err = verifyData(job, image, mask, &errors);
+            if(err == 0 && trailer != NULL && (err = verifyData(job, trailer, mask, &trailerErrors)) == 0)
+                errors += trailerErrors;
+            if(err != 0){
+                printError(job, "Error reading back flash", err);
+                goto errorOccurred;
+            }
+            if(errors > 0){
+                fprintf(stderr, "Verify failed in %d page(s)!\n", errors);
+                err = -1;
+                goto errorOccurred;
+            }
+            message("Verify OK\n");
+        }
     }
+    if(eepromImage != NULL && (err = uploadEeprom(job, eepromImage, &caps)) != 0)
+        goto errorOccurred;
     if(leaveBootLoader){
         /* and now leave boot loader: */
         buffer.info.reportId = 1;
-        usbSetReport(dev, USB_HID_REPORT_TYPE_FEATURE, buffer.bytes, sizeof(buffer.info));
+        setReport(job, buffer.bytes, sizeof(buffer.info));
+        job->exitTime = wallClock();
         /* Ignore errors here. If the device reboots before we poll the response,
          * this request fails.
          */
     }
 errorOccurred:
-    if(dev != NULL)
-        usbCloseDevice(dev);
+    imageFree(trailer);
+    return err;
+}
+
+/* ------------------------------------------------------------------------- */
+
+static int  findLocation(char (*locations)[USB_LOCATION_LEN], int count, char *location)
+{
+int i;
+
+    for(i = 0; i < count; i++){
+        if(strcmp(locations[i], location) == 0)
+            return i;
+    }
+    return -1;
+}
+
+/* Lists the port paths of all USB devices which are not boot loaders. The
+ * number of boot loaders is returned in '*numBootLoaders'.
+ */
+static int  listOtherDevices(char (*locations)[USB_LOCATION_LEN], int *numBootLoaders)
+{
+static char bootLoaders[MAX_USB_DEVICES][USB_LOCATION_LEN];
+int         count, i, numOthers = 0;
+
+    *numBootLoaders = usbListDevices(IDENT_VENDOR_NUM, IDENT_PRODUCT_NUM, bootLoaders, MAX_USB_DEVICES);
+    count = usbListDevices(0, 0, locations, MAX_USB_DEVICES);
+    for(i = 0; i < count; i++){
+        if(findLocation(bootLoaders, *numBootLoaders, locations[i]) >= 0)
+            continue;
+        if(i != numOthers)
+            strcpy(locations[numOthers], locations[i]);
+        numOthers++;
+    }
+    return numOthers;
+}
+
+/* Reports how long it takes from 'start' on until the boot loader has left
+ * the bus and until a device which is not in 'before' has enumerated, which
+ * we take as the application.
+ */
+static void reportExitTime(char (*before)[USB_LOCATION_LEN], int numBefore, int numBootLoaders, double start)
+{
+static char locations[MAX_USB_DEVICES][USB_LOCATION_LEN];
+double      deadline = start + EXIT_TIME_LIMIT, leftAt = 0, now;
+int         count, remaining, i;
+
+    do{
+        now = wallClock();
+        count = listOtherDevices(locations, &remaining);
+        if(leftAt == 0 && remaining < numBootLoaders)
+            leftAt = now;
+        if(leftAt != 0){
+            for(i = 0; i < count; i++){
+                if(findLocation(before, numBefore, locations[i]) < 0){
+                    printf("Boot loader left after %.0f ms, application enumerated after %.0f ms\n", (leftAt - start) * 1000, (now - start) * 1000);
+                    return;
+                }
+            }
+        }
+    }while(!waitForChange(deadline, EXIT_POLL_MS));
+    if(leftAt == 0){
+        printf("Boot loader still connected after %d s\n", EXIT_TIME_LIMIT);
+    }else{
+        printf("Boot loader left after %.0f ms, no application enumerated within %d s\n", (leftAt - start) * 1000, EXIT_TIME_LIMIT);
+    }
+}
+
+/* Opens the boot loader and uploads the image. With --wait, we wait for the
+ * device to appear first.
+ */
+static int  flashDevice(image_t *image)
+{
+static char before[MAX_USB_DEVICES][USB_LOCATION_LEN];
+flashJob_t  job;
+char        *location = numDeviceLocations > 0 ? deviceLocations[0] : NULL;
+double      deadline = waitTimeout > 0 ? wallClock() + waitTimeout : 0, start;
+int         err, waiting = 0, numBefore = 0, numBootLoaders = 0;
+
+    memset(&job, 0, sizeof(job));
+    while((err = openDevice(&job, location)) == USB_ERROR_NOTFOUND && waitForDevice){
+        if(!waiting){
+            printf("Waiting for HIDBoot device\n");
+            fflush(stdout);
+            waiting = 1;
+        }
+        if(waitForChange(deadline, -1))
+            break;
+    }
+    if(waiting){    /* the device has just appeared, see reconnectDevice() */
+        deadline = wallClock() + RECONNECT_TIMEOUT;
+        while((err == USB_ERROR_ACCESS || err == USB_ERROR_IO) && !waitForChange(deadline, 100))
+            err = openDevice(&job, location);
+    }
+    if(err != 0){
+        fprintf(stderr, "Error opening HIDBoot device: %s\n", usbErrorMessage(err));
+        return err;
+    }
+    if(measureExit)     /* the application may have been connected until now */
+        numBefore = listOtherDevices(before, &numBootLoaders);
+    start = monotonicClock();
+    err = uploadData(&job, image);
+    usbCloseDevice(job.dev);
+    job.stats.seconds = job.stats.openSeconds + monotonicClock() - start;
+    statsMerge(&totalStats, &job.stats);
+    if(err == 0 && measureExit)
+        reportExitTime(before, numBefore, numBootLoaders, job.exitTime);
     return err;
 }
 
 /* ------------------------------------------------------------------------- */
 
+static void runJob(flashJob_t *job)
+{
+double  start = monotonicClock();
+
+    if((job->err = openDevice(job, job->location)) == 0){
+        job->err = uploadData(job, job->image);
+        usbCloseDevice(job->dev);
+        job->dev = NULL;
+    }
+    job->seconds = monotonicClock() - start;
+    job->stats.seconds = job->seconds;
+}
+
+#if defined(WIN32)
+static DWORD WINAPI flashThread(LPVOID arg)
+#else
+static void *flashThread(void *arg)
+#endif
+{
+flashJob_t  *job = arg;
+
+    runJob(job);
+    job->done = 1;
+    return 0;
+}
+
+/* Runs the job in a thread of its own. If no thread can be created, the job
+ * is run right away.
+ */
+static void startJob(flashJob_t *job)
+{
+#if defined(WIN32)
+    job->threaded = (job->thread = CreateThread(NULL, 0, flashThread, job, 0, NULL)) != NULL;
+#else
+    job->threaded = pthread_create(&job->thread, NULL, flashThread, job) == 0;
+#endif
+    if(!job->threaded)
+        flashThread(job);
+}
+
+static void joinJob(flashJob_t *job)
+{
+    if(!job->threaded)
+        return;
+#if defined(WIN32)
+    WaitForSingleObject(job->thread, INFINITE);
+    CloseHandle(job->thread);
+#else
+    pthread_join(job->thread, NULL);
+#endif
+}
+
+static void printResult(flashJob_t *job)
+{
+static int  didPrintHeader = 0;
+char        *result = job->err == 0 ? "OK" : job->err < 0 ? "failed" : usbErrorMessage(job->err);
+
+    if(!didPrintHeader){
+        printf("%-20s %8s %8s %8s  %s\n", "Device", "Sent", "Skipped", "Seconds", "Result");
+        didPrintHeader = 1;
+    }
+    printf("%-20s %8d %8d %8.2f  %s\n", job->location, job->blocksSent, job->blocksSkipped, job->seconds, result);
+    fflush(stdout);
+}
+
+/* Joins finished jobs (or all jobs if 'wait' is set), prints their results
+ * and frees their slots. Returns the number of jobs still running.
+ */
+static int  reapJobs(flashJob_t *jobs, int wait, int *numOk, int *numFailed)
+{
+int i, k, numActive = 0;
+
+    for(i = 0; i < MAX_DEVICES; i++){
+        if(jobs[i].location[0] == 0)
+            continue;   /* free slot */
+        if(!wait && !jobs[i].done){
+            numActive++;
+            continue;
+        }
+        joinJob(&jobs[i]);
+        if(jobs[i].err == USB_ERROR_NOTFOUND){
+            /* not a HIDBoot device or gone */
+        }else if(jobs[i].err == 0){
+            printResult(&jobs[i]);
+            (*numOk)++;
+        }else{
+            printResult(&jobs[i]);
+            (*numFailed)++;
+        }
+        if(jobs[i].err != USB_ERROR_NOTFOUND){
+            statsMerge(&totalStats, &jobs[i].stats);
+            if((k = findLocation(deviceLocations, numDeviceLocations, jobs[i].location)) >= 0)
+                deviceLocationDone[k] = 1;
+        }
+        free(jobs[i].stats.latencies);
+        memset(&jobs[i], 0, sizeof(jobs[i]));
+    }
+    return numActive;
+}
+
+/* Uploads the image to all connected boot loaders (or those given with
+ * --path) concurrently, one thread per device. The image is shared read-only
+ * by all threads. With --wait, we keep waiting for new devices until none
+ * appeared for the timeout (or forever). Devices which have been handled are
+ * remembered until they disconnect, so a device which stays in the boot
+ * loader is not flashed again. If more than MAX_DEVICES devices are
+ * connected, the others wait for a free slot. Devices given with --path
+ * which were not found are reported as failed at the end.
+ */
+static int  flashAllDevices(image_t *image)
+{
+static char         locations[MAX_DEVICES][USB_LOCATION_LEN], handled[MAX_DEVICES][USB_LOCATION_LEN];
+static flashJob_t   jobs[MAX_DEVICES];
+flashJob_t          *job, missing;
+double              deadline = waitTimeout > 0 ? wallClock() + waitTimeout : 0;
+double              start = wallClock();
+int                 numLocations, numHandled = 0, numActive = 0, numWaiting, numOk = 0, numFailed = 0, i, j;
+
+    quiet = 1;  /* progress output of several threads would be garbled */
+    for(;;){
+        numLocations = usbListDevices(IDENT_VENDOR_NUM, IDENT_PRODUCT_NUM, locations, MAX_DEVICES);
+        for(i = j = 0; i < numHandled; i++){    /* forget devices which are gone */
+            if(findLocation(locations, numLocations, handled[i]) >= 0)
+                memmove(handled[j++], handled[i], USB_LOCATION_LEN);
+        }
+        numHandled = j;
+        numWaiting = 0;
+        for(i = 0; i < numLocations; i++){
+            if(findLocation(handled, numHandled, locations[i]) >= 0)
+                continue;
+            if(numDeviceLocations > 0 && findLocation(deviceLocations, numDeviceLocations, locations[i]) < 0)
+                continue;
+            for(job = jobs; job < jobs + MAX_DEVICES && job->location[0] != 0; job++);
+            if(job >= jobs + MAX_DEVICES){
+                numWaiting++;   /* try again when a slot is free */
+                continue;
+            }
+            memcpy(handled[numHandled++], locations[i], USB_LOCATION_LEN);
+            memcpy(job->location, locations[i], USB_LOCATION_LEN);
+            job->image = image;
+            startJob(job);  /* the device is opened by the thread */
+            if(waitTimeout > 0)
+                deadline = wallClock() + waitTimeout;
+        }
+        numActive = reapJobs(jobs, 0, &numOk, &numFailed);
+        if(numWaiting > 0){
+            waitForChange(0, 100);  /* until a job is done */
+        }else if(!waitForDevice || waitForChange(deadline, numActive > 0 ? 1000 : -1)){
+            break;
+        }
+    }
+    reapJobs(jobs, 1, &numOk, &numFailed);
+    for(i = 0; i < numDeviceLocations; i++){
+        if(deviceLocationDone[i] || findLocation(deviceLocations, i, deviceLocations[i]) >= 0)
+            continue;   /* flashed or given twice */
+        memset(&missing, 0, sizeof(missing));
+        memcpy(missing.location, deviceLocations[i], USB_LOCATION_LEN);
+        missing.err = USB_ERROR_NOTFOUND;
+        printResult(&missing);
+        numFailed++;
+    }
+    if(numOk + numFailed == 0){
+        fprintf(stderr, "Error opening HIDBoot device: %s\n", usbErrorMessage(USB_ERROR_NOTFOUND));
+        return USB_ERROR_NOTFOUND;
+    }
+    printf("%d device(s) flashed, %d failed in %.2f seconds\n", numOk, numFailed, wallClock() - start);
+    return numFailed;
+}
+
+/* ------------------------------------------------------------------------- */
+
+/* Sends the boot loader request to the running application at 'location' (any
+ * if NULL). The application resets, we don't expect an answer.
+ */
+static int  triggerApp(char *location)
+{
+usbDevice_t *dev;
+char        report[1 + sizeof(FROM_APP_MAGIC) - 1];
+int         err;
+
+    if((err = usbOpenDeviceAt(&dev, appVendor, NULL, appProduct, NULL, appReportId != 0, location, deviceSerial)) != 0)
+        return err;
+    report[0] = appReportId;
+    memcpy(report + 1, FROM_APP_MAGIC, sizeof(report) - 1);
+    usbSetReport(dev, USB_HID_REPORT_TYPE_FEATURE, report, sizeof(report));
+    usbCloseDevice(dev);
+    return 0;
+}
+
+/* Asks the applications selected with --path or --all (or the first one
+ * found) to start the boot loader. We then wait for the boot loaders to
+ * appear.
+ */
+static int  enterFromApp(void)
+{
+static char locations[MAX_DEVICES][USB_LOCATION_LEN];
+int         count, i, numTriggered = 0;
+
+    if(numDeviceLocations > 0){
+        count = numDeviceLocations;
+        memcpy(locations, deviceLocations, sizeof(locations));
+    }else if(allDevices){
+        count = usbListDevices(appVendor, appProduct, locations, MAX_DEVICES);
+    }else{
+        count = 0;
+        numTriggered = triggerApp(NULL) == 0;
+    }
+    for(i = 0; i < count; i++){
+        if(findLocation(locations, i, locations[i]) >= 0)
+            continue;   /* hidraw lists each HID interface */
+        if(triggerApp(locations[i]) == 0)
+            numTriggered++;
+    }
+    if(numTriggered == 0){
+        fprintf(stderr, "Error opening application %04x:%04x: %s\n", appVendor, appProduct, usbErrorMessage(USB_ERROR_NOTFOUND));
+        return USB_ERROR_NOTFOUND;
+    }
+    printf("Requested boot loader from %d application(s)\n", numTriggered);
+    waitForDevice = 1;
+    if(waitTimeout == 0)
+        waitTimeout = FROM_APP_WAIT;
+    return 0;
+}
+
+/* ------------------------------------------------------------------------- */
+
 static void printUsage(char *pname)
 {
-    fprintf(stderr, "usage: %s [-r] [<intel-hexfile>]\n", pname);
+    fprintf(stderr, "usage: %s [-r] [--exit-time] [--verify] [--path <port>] [--serial <sn>] [--wait[=<sec>]] [--all]\n", pname);
+    fprintf(stderr, "       [--from-app <vid>:<pid>[:<id>]] [--eeprom <eep-file>] [--mcu <name>] [--stats[=json]]\n");
+    fprintf(stderr, "       [<intel-hexfile>]\n");
+    fprintf(stderr, "  -r ............ leave boot loader and start the application\n");
+    fprintf(stderr, "  --exit-time ... like -r, report when the application has enumerated\n");
+    fprintf(stderr, "  --verify ...... read back flash after upload and compare with the file\n");
+    fprintf(stderr, "  --path <port> . use only the device at this USB port (e.g. 1-1.4), give\n");
+    fprintf(stderr, "                  several times to flash a list of devices\n");
+    fprintf(stderr, "  --serial <sn> . use only the device with this serial number\n");
+    fprintf(stderr, "  --wait[=<sec>]  wait for the device to be connected, forever or <sec> seconds\n");
+    fprintf(stderr, "  --all ......... flash all connected devices concurrently, with --wait also\n");
+    fprintf(stderr, "                  devices connected later\n");
+    fprintf(stderr, "  --eeprom <eep-file>  write this Intel-Hex file to EEPROM\n");
+    fprintf(stderr, "  --mcu <name> .. the files are for this MCU (e.g. atmega328p or signature\n");
+    fprintf(stderr, "                  1e950f), refuse to flash other devices\n");
+    fprintf(stderr, "  --stats[=json]  print transfer statistics and latencies at the end\n");
+    fprintf(stderr, "  --from-app <vid>:<pid>[:<id>]  ask the running application with this\n");
+    fprintf(stderr, "                  (hex) ID to start the boot loader with feature report <id>\n");
 }
 
 int main(int argc, char **argv)
 {
-char    *file = NULL;
+char    *file = NULL, *eepromFile = NULL;
+int     i, err;
 
     if(argc < 2){
         printUsage(argv[0]);
         return 1;
     }
-    if(strcmp(argv[1], "-h") == 0 || strcmp(argv[1], "--help") == 0){
-        printUsage(argv[0]);
-        return 1;
-    }
-    if(strcmp(argv[1], "-r") == 0){
-        leaveBootLoader = 1;
-        if(argc >= 3){
-            file = argv[2];
+    for(i = 1; i < argc; i++){
+        if(strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0){
+            printUsage(argv[0]);
+            return 1;
+        }else if(strcmp(argv[i], "-r") == 0){
+            leaveBootLoader = 1;
+        }else if(strcmp(argv[i], "--exit-time") == 0){
+            leaveBootLoader = 1;
+            measureExit = 1;
+        }else if(strcmp(argv[i], "--verify") == 0){
+            verifyAfterWrite = 1;
+        }else if(strcmp(argv[i], "--path") == 0 && i + 1 < argc){
+            i++;
+            if(numDeviceLocations < MAX_DEVICES)
+                strncpy(deviceLocations[numDeviceLocations++], argv[i], USB_LOCATION_LEN - 1);
+        }else if(strcmp(argv[i], "--serial") == 0 && i + 1 < argc){
+            deviceSerial = argv[++i];
+        }else if(strcmp(argv[i], "--wait") == 0){
+            waitForDevice = 1;
+        }else if(strncmp(argv[i], "--wait=", 7) == 0){
+            waitForDevice = 1;
+            waitTimeout = atoi(argv[i] + 7);
+        }else if(strcmp(argv[i], "--all") == 0){
+            allDevices = 1;
+        }else if(strcmp(argv[i], "--eeprom") == 0 && i + 1 < argc){
+            eepromFile = argv[++i];
+        }else if(strcmp(argv[i], "--stats") == 0 || strcmp(argv[i], "--stats=text") == 0){
+            statsFormat = STATS_TEXT;
+        }else if(strcmp(argv[i], "--stats=json") == 0){
+            statsFormat = STATS_JSON;
+        }else if(strcmp(argv[i], "--mcu") == 0 && i + 1 < argc){
+            if((targetSignature = mcuSignature(argv[++i])) < 0){
+                fprintf(stderr, "Unknown MCU \"%s\", give the signature as 6 hex digits\n", argv[i]);
+                return 1;
+            }
+        }else if(strcmp(argv[i], "--from-app") == 0 && i + 1 < argc){
+            if(sscanf(argv[++i], "%x:%x:%x", &appVendor, &appProduct, &appReportId) < 2 || appVendor == 0){
+                printUsage(argv[0]);
+                return 1;
+            }
+        }else if(argv[i][0] == '-' || file != NULL){
+            printUsage(argv[0]);
+            return 1;
+        }else{
+            file = argv[i];
         }
-    }else{
-        file = argv[1];
     }
-    startAddress = sizeof(dataBuffer);
-    endAddress = 0;
     if(file != NULL){   // an upload file was given, load the data
-        memset(dataBuffer, -1, sizeof(dataBuffer));
-        if(parseIntelHex(file, dataBuffer, &startAddress, &endAddress))
+        if((image = imageNew()) == NULL){
+            fprintf(stderr, "Out of memory\n");
+            return 1;
+        }
+        if(parseIntelHex(file, image))
             return 1;
-        if(startAddress >= endAddress){
+        if(image->usedBlocks == 0){
             fprintf(stderr, "No data in input file, exiting.\n");
             return 0;
         }
     }
-    // if no file was given, endAddress is less than startAddress and no data is uploaded
-    if(uploadData(dataBuffer, startAddress, endAddress))
+    if(eepromFile != NULL){
+        if((eepromImage = imageNew()) == NULL){
+            fprintf(stderr, "Out of memory\n");
+            return 1;
+        }
+        if(parseIntelHex(eepromFile, eepromImage))
+            return 1;
+        if(eepromImage->usedBlocks == 0){
+            imageFree(eepromImage);
+            eepromImage = NULL;
+        }
+    }
+    // if no file was given, image is NULL and no data is uploaded
+    if(numDeviceLocations > 1)  /* a list of devices was given */
+        allDevices = 1;
+    if(appVendor != 0 && enterFromApp() != 0)
         return 1;
-    return 0;
+    err = allDevices ? flashAllDevices(image) : flashDevice(image);
+    if(statsFormat)     /* also if flashing failed */
+        printStats(&totalStats);
+    free(totalStats.latencies);
+    imageFree(image);
+    imageFree(eepromImage);
+    return err != 0;
 }
 
 /* ------------------------------------------------------------------------- */
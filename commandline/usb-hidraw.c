@@ -0,0 +1,333 @@
+/* Name: usb-hidraw.c
+ * Project: usbcalls library
+ * Creation Date: 2026-10-17
+ * Tabsize: 4
+ * Copyright: (c) 2006 by OBJECTIVE DEVELOPMENT Software GmbH
+ * License: Proprietary, free under certain conditions. See Documentation.
+ */
+
+/*
+General Description:
+This module implements USB HID report receiving/sending with the Linux hidraw
+driver. Devices are found by scanning /sys/class/hidraw, reports are
+transferred with the HIDIOCSFEATURE and HIDIOCGFEATURE ioctls on the
+/dev/hidrawN device node. The kernel HID driver stays attached, no interface
+needs to be claimed and access can be granted to unprivileged users with the
+permissions of the device node.
+
+The kernel derives the HID device name from the manufacturer and product
+strings, separated by a space. We compare against this name instead of
+querying the string descriptors.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <linux/hidraw.h>
+#include <linux/netlink.h>
+
+#include "usbcalls.h"
+
+/* ------------------------------------------------------------------------- */
+
+#define SYSFS_HIDRAW    "/sys/class/hidraw"
+#define USB_POLL_MS     100 /* poll interval if netlink is not available */
+#define UDEV_CONTROL    "/run/udev/control" /* exists while udev is running */
+
+struct usbDevice{
+    usbDeviceState_t    state;
+    int                 fd;
+};
+
+/* ------------------------------------------------------------------------- */
+
+/* Reads the HID_ID, HID_NAME and HID_UNIQ (serial number) entries from the
+ * uevent file of a hidraw device. Returns 0 on success.
+ */
+static int  readHidUevent(char *hidrawName, int *vendor, int *product, char *name, int nameLen, char *serial, int serialLen)
+{
+char    path[512], line[256];
+FILE    *fp;
+int     bus, found = 0;
+
+    snprintf(path, sizeof(path), SYSFS_HIDRAW "/%s/device/uevent", hidrawName);
+    if((fp = fopen(path, "r")) == NULL)
+        return -1;
+    name[0] = 0;
+    serial[0] = 0;
+    while(fgets(line, sizeof(line), fp) != NULL){
+        line[strcspn(line, "\n")] = 0;
+        if(sscanf(line, "HID_ID=%x:%x:%x", &bus, vendor, product) == 3){
+            found = 1;
+        }else if(strncmp(line, "HID_NAME=", 9) == 0){
+            snprintf(name, nameLen, "%s", line + 9);
+        }else if(strncmp(line, "HID_UNIQ=", 9) == 0){
+            snprintf(serial, serialLen, "%s", line + 9);
+        }
+    }
+    fclose(fp);
+    return found ? 0 : -1;
+}
+
+/* Determines the USB port path of a hidraw device. The HID device is a child
+ * of the USB interface, which is named "<port path>:<config>.<interface>".
+ */
+static int  readHidLocation(char *hidrawName, char *location, int len)
+{
+char    path[512], target[PATH_MAX], *p;
+
+    snprintf(path, sizeof(path), SYSFS_HIDRAW "/%s/device", hidrawName);
+    if(realpath(path, target) == NULL)
+        return -1;
+    if((p = strrchr(target, '/')) == NULL)
+        return -1;
+    *p = 0;     /* strip HID device, leaves the interface */
+    if((p = strrchr(target, '/')) == NULL)
+        return -1;
+    snprintf(location, len, "%.*s", (int)strcspn(p + 1, ":"), p + 1);
+    return 0;
+}
+
+int usbOpenDevice(usbDevice_t **device, int vendor, char *vendorName, int product, char *productName, int usesReportIDs)
+{
+    return usbOpenDeviceAt(device, vendor, vendorName, product, productName, usesReportIDs, NULL, NULL);
+}
+
+/* The names come from sysfs and are cheap to compare, so we don't need the
+ * identity cache here.
+ */
+int usbOpenDeviceAt(usbDevice_t **device, int vendor, char *vendorName, int product, char *productName, int usesReportIDs, char *location, char *serial)
+{
+DIR             *dir;
+struct dirent   *entry;
+char            name[256], expectedName[512], path[512], devSerial[256], devLocation[USB_LOCATION_LEN];
+int             devVendor, devProduct, fd = -1;
+int             errorCode = USB_ERROR_NOTFOUND;
+
+    if((dir = opendir(SYSFS_HIDRAW)) == NULL){
+        fprintf(stderr, "Warning: cannot read %s: %s\n", SYSFS_HIDRAW, strerror(errno));
+        return USB_ERROR_NOTFOUND;
+    }
+    if(vendorName != NULL && productName != NULL)
+        snprintf(expectedName, sizeof(expectedName), "%s %s", vendorName, productName);
+    while((entry = readdir(dir)) != NULL){
+        if(strncmp(entry->d_name, "hidraw", 6) != 0)
+            continue;
+        if(readHidUevent(entry->d_name, &devVendor, &devProduct, name, sizeof(name), devSerial, sizeof(devSerial)) != 0)
+            continue;
+        if(devVendor != vendor || devProduct != product)
+            continue;
+        if(vendorName != NULL && productName != NULL && strcmp(name, expectedName) != 0)
+            continue;
+        if(serial != NULL && strcmp(devSerial, serial) != 0)
+            continue;
+        if(location != NULL && (readHidLocation(entry->d_name, devLocation, sizeof(devLocation)) != 0 || strcmp(devLocation, location) != 0))
+            continue;
+        snprintf(path, sizeof(path), "/dev/%s", entry->d_name);
+        if((fd = open(path, O_RDWR)) < 0){
+            errorCode = errno == EACCES ? USB_ERROR_ACCESS : USB_ERROR_IO;
+            fprintf(stderr, "Warning: cannot open %s: %s\n", path, strerror(errno));
+            continue;
+        }
+        break;
+    }
+    closedir(dir);
+    if(fd >= 0){
+        if((*device = malloc(sizeof(usbDevice_t))) == NULL){
+            close(fd);
+            return USB_ERROR_IO;
+        }
+        usbInitState(&(*device)->state, usesReportIDs);
+        (*device)->fd = fd;
+        errorCode = 0;
+    }
+    return errorCode;
+}
+
+int usbListDevices(int vendor, int product, char (*locations)[USB_LOCATION_LEN], int maxLocations)
+{
+DIR             *dir;
+struct dirent   *entry;
+char            name[256], serial[256];
+int             devVendor, devProduct, count = 0;
+
+    if((dir = opendir(SYSFS_HIDRAW)) == NULL)
+        return 0;
+    while((entry = readdir(dir)) != NULL && count < maxLocations){
+        if(strncmp(entry->d_name, "hidraw", 6) != 0)
+            continue;
+        if(readHidUevent(entry->d_name, &devVendor, &devProduct, name, sizeof(name), serial, sizeof(serial)) != 0)
+            continue;
+        if(vendor != 0 && (devVendor != vendor || devProduct != product))
+            continue;
+        if(readHidLocation(entry->d_name, locations[count], USB_LOCATION_LEN) == 0)
+            count++;
+    }
+    closedir(dir);
+    return count;
+}
+
+/* ------------------------------------------------------------------------- */
+
+/* Messages of the kernel consist of "<action>@<devpath>" and the properties,
+ * messages of udev of a binary header and the properties, all separated by
+ * null bytes. We look for the hidraw class in any of them.
+ */
+static int  isHidrawEvent(char *buffer, int len)
+{
+char    *p;
+
+    for(p = buffer; p < buffer + len; p += strlen(p) + 1){
+        if(strstr(p, "/hidraw/") != NULL)
+            return 1;
+    }
+    return 0;
+}
+
+/* We listen for uevents on a netlink socket and wake up on any hidraw event.
+ * If udev is running, we take its events because it sends them after it has
+ * set the permissions of the device node. The kernel's events come before
+ * that and opening the device would fail with USB_ERROR_ACCESS. The socket
+ * stays open between calls so that events which occur while the caller scans
+ * for devices are queued.
+ */
+int usbWaitForChange(int vendor, int product, int timeoutMs)
+{
+static int          sock = -1;  /* -2 if netlink is not available */
+struct sockaddr_nl  addr;
+struct pollfd       pfd;
+struct timespec     now, deadline;
+char                buffer[4096];
+int                 len, isNew = 0, remaining = timeoutMs;
+
+    usbLock();
+    if(sock == -1){
+        memset(&addr, 0, sizeof(addr));
+        addr.nl_family = AF_NETLINK;
+        addr.nl_groups = access(UDEV_CONTROL, F_OK) == 0 ? 2 : 1;  /* udev or kernel events */
+        if((sock = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT)) >= 0 && bind(sock, (struct sockaddr *)&addr, sizeof(addr)) == 0){
+            isNew = 1;
+        }else{
+            if(sock >= 0)
+                close(sock);
+            sock = -2;  /* don't try again */
+        }
+    }
+    usbUnlock();
+    if(isNew)
+        return 0;   /* the device may have arrived before we listened */
+    if(sock < 0){
+        if(timeoutMs < 0 || timeoutMs > USB_POLL_MS)
+            timeoutMs = USB_POLL_MS;
+        usleep(timeoutMs * 1000);
+        return 0;
+    }
+    pfd.fd = sock;
+    pfd.events = POLLIN;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeoutMs / 1000;
+    deadline.tv_nsec += (timeoutMs % 1000) * 1000000L;
+    while(poll(&pfd, 1, remaining) > 0){
+        if((len = recv(sock, buffer, sizeof(buffer) - 1, 0)) <= 0)
+            return USB_ERROR_IO;
+        buffer[len] = 0;
+        if(isHidrawEvent(buffer, len))
+            return 0;
+        if(timeoutMs >= 0){ /* other events don't extend the timeout */
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            remaining = (deadline.tv_sec - now.tv_sec) * 1000 + (deadline.tv_nsec - now.tv_nsec) / 1000000;
+            if(remaining <= 0)
+                break;
+        }
+    }
+    return 0;
+}
+
+/* ------------------------------------------------------------------------- */
+
+void    usbCloseDevice(usbDevice_t *device)
+{
+    if(device != NULL){
+        close(device->fd);
+        free(device);
+    }
+}
+
+/* ------------------------------------------------------------------------- */
+
+/* hidraw expects the report ID in the first byte and 0 for devices without
+ * report IDs, which is what our callers pass anyway.
+ */
+int usbSetReport(usbDevice_t *device, int reportType, char *buffer, int len)
+{
+int bytesSent;
+
+    switch(reportType){
+    case USB_HID_REPORT_TYPE_OUTPUT:
+        bytesSent = write(device->fd, buffer, len);
+        break;
+    case USB_HID_REPORT_TYPE_FEATURE:
+        bytesSent = ioctl(device->fd, HIDIOCSFEATURE(len), buffer);
+        break;
+    default:
+        return usbError(&device->state, USB_ERROR_IO, "unsupported report type %d", reportType);
+    }
+    if(bytesSent != len){
+        if(bytesSent < 0)
+            return usbError(&device->state, USB_ERROR_IO, "%s", strerror(errno));
+        return usbError(&device->state, USB_ERROR_IO, "short write (%d of %d bytes)", bytesSent, len);
+    }
+    device->state.counters.reportsSent++;
+    device->state.counters.bytesSent += len;
+    return 0;
+}
+
+/* ------------------------------------------------------------------------- */
+
+int usbGetReport(usbDevice_t *device, int reportType, int reportNumber, char *buffer, int *len)
+{
+int bytesReceived;
+
+    buffer[0] = reportNumber;
+    switch(reportType){
+    case USB_HID_REPORT_TYPE_INPUT:
+        bytesReceived = read(device->fd, buffer, *len);
+        break;
+    case USB_HID_REPORT_TYPE_FEATURE:
+        bytesReceived = ioctl(device->fd, HIDIOCGFEATURE(*len), buffer);
+        break;
+    default:
+        return usbError(&device->state, USB_ERROR_IO, "unsupported report type %d", reportType);
+    }
+    if(bytesReceived < 0)
+        return usbError(&device->state, USB_ERROR_IO, "%s", strerror(errno));
+    device->state.counters.reportsReceived++;
+    device->state.counters.bytesReceived += bytesReceived;
+    if(!device->state.usesReportIDs)
+        buffer[0] = reportNumber;   /* hidraw returns 0 as dummy report ID */
+    *len = bytesReceived;
+    return 0;
+}
+
+/* ------------------------------------------------------------------------- */
+
+int usbSetReportAsync(usbDevice_t *device, int reportType, char *buffer, int len)
+{
+    return usbSetReport(device, reportType, buffer, len);   /* no async support */
+}
+
+int usbFlush(usbDevice_t *device)
+{
+    return 0;
+}
+
+/* ------------------------------------------------------------------------- */
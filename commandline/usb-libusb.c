@@ -17,17 +17,18 @@ compatible with the Windows implementation, we add a zero report ID for all
 reports which don't have an ID. Since we don't parse the descriptor, the caller
 must tell us whether report IDs are used or not in usbOpenDevice().
 
-The implementation of dummy report IDs is a hack. Whether they are used is
-stored in a global variable, not in the device structure (just laziness, don't
-want to allocate memory for that). If you open more than one device and the
-devices differ in report ID usage, you must change the code.
+Whether dummy report IDs are used is stored in the device structure, so
+several devices can be used at the same time, also from different threads.
+libusb-0.1 itself is not thread safe when it scans the bus, so opening and
+listing devices is serialized.
 */
 
 #include <stdio.h>
 #include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
 #include <usb.h>
 
-#define usbDevice   usb_dev_handle  /* use libusb's device structure */
 #include "usbcalls.h"
 
 /* ------------------------------------------------------------------------- */
@@ -35,7 +36,27 @@ devices differ in report ID usage, you must change the code.
 #define USBRQ_HID_GET_REPORT    0x01
 #define USBRQ_HID_SET_REPORT    0x09
 
-static int  usesReportIDs;
+#define USB_POLL_MS             100 /* poll interval for usbWaitForChange() */
+
+struct usbDevice{
+    usbDeviceState_t    state;
+    usb_dev_handle      *handle;
+};
+
+/* ------------------------------------------------------------------------- */
+
+/* Must be called with the lock held. */
+static void initUsb(void)
+{
+static int  didUsbInit = 0;
+
+    if(!didUsbInit){
+        usb_init();
+        didUsbInit = 1;
+    }
+    usb_find_busses();
+    usb_find_devices();
+}
 
 /* ------------------------------------------------------------------------- */
 
@@ -63,62 +84,76 @@ int     rval, i;
     return i-1;
 }
 
+/* Compares a string descriptor with 'expected'. Returns 0 if it matches,
+ * USB_ERROR_NOTFOUND if not and USB_ERROR_IO if it can't be read.
+ */
+static int  checkString(usb_dev_handle *handle, int index, char *expected, char *what)
+{
+char    string[256];
+int     len;
+
+    len = usbGetStringAscii(handle, index, 0x0409, string, sizeof(string));
+    if(len < 0){
+        fprintf(stderr, "Warning: cannot query %s for device: %s\n", what, usb_strerror());
+        return USB_ERROR_IO;
+    }
+    /* fprintf(stderr, "seen %s ->%s<-\n", what, string); */
+    return strcmp(string, expected) == 0 ? 0 : USB_ERROR_NOTFOUND;
+}
+
 int usbOpenDevice(usbDevice_t **device, int vendor, char *vendorName, int product, char *productName, int _usesReportIDs)
+{
+    return usbOpenDeviceAt(device, vendor, vendorName, product, productName, _usesReportIDs, NULL, NULL);
+}
+
+int usbOpenDeviceAt(usbDevice_t **device, int vendor, char *vendorName, int product, char *productName, int _usesReportIDs, char *location, char *serial)
 {
 struct usb_bus      *bus;
 struct usb_device   *dev;
 usb_dev_handle      *handle = NULL;
 int                 errorCode = USB_ERROR_NOTFOUND;
-static int          didUsbInit = 0;
+char                path[USB_LOCATION_LEN];
 
-    if(!didUsbInit){
-        usb_init();
-        didUsbInit = 1;
-    }
-    usb_find_busses();
-    usb_find_devices();
+    usbLock();
+    initUsb();
     for(bus=usb_get_busses(); bus; bus=bus->next){
         for(dev=bus->devices; dev; dev=dev->next){
-            if(dev->descriptor.idVendor == vendor && dev->descriptor.idProduct == product){
-                char    string[256];
-                int     len;
-                handle = usb_open(dev); /* we need to open the device in order to query strings */
-                if(!handle){
-                    errorCode = USB_ERROR_ACCESS;
-                    fprintf(stderr, "Warning: cannot open USB device: %s\n", usb_strerror());
-                    continue;
-                }
-                if(vendorName == NULL && productName == NULL){  /* name does not matter */
-                    break;
-                }
-                /* now check whether the names match: */
-                len = usbGetStringAscii(handle, dev->descriptor.iManufacturer, 0x0409, string, sizeof(string));
-                if(len < 0){
-                    errorCode = USB_ERROR_IO;
-                    fprintf(stderr, "Warning: cannot query manufacturer for device: %s\n", usb_strerror());
-                }else{
-                    errorCode = USB_ERROR_NOTFOUND;
-                    /* fprintf(stderr, "seen device from vendor ->%s<-\n", string); */
-                    if(strcmp(string, vendorName) == 0){
-                        len = usbGetStringAscii(handle, dev->descriptor.iProduct, 0x0409, string, sizeof(string));
-                        if(len < 0){
-                            errorCode = USB_ERROR_IO;
-                            fprintf(stderr, "Warning: cannot query product for device: %s\n", usb_strerror());
-                        }else{
-                            errorCode = USB_ERROR_NOTFOUND;
-                            /* fprintf(stderr, "seen product ->%s<-\n", string); */
-                            if(strcmp(string, productName) == 0)
-                                break;
-                        }
-                    }
-                }
+            if(dev->descriptor.idVendor != vendor || dev->descriptor.idProduct != product)
+                continue;
+            snprintf(path, sizeof(path), "%s/%s", bus->dirname, dev->filename);
+            if(location != NULL && strcmp(path, location) != 0)
+                continue;   /* no need to open devices at other locations */
+            handle = usb_open(dev); /* we need to open the device in order to query strings */
+            if(!handle){
+                errorCode = USB_ERROR_ACCESS;
+                fprintf(stderr, "Warning: cannot open USB device: %s\n", usb_strerror());
+                continue;
+            }
+            if(serial != NULL && (errorCode = checkString(handle, dev->descriptor.iSerialNumber, serial, "serial number")) != 0){
                 usb_close(handle);
                 handle = NULL;
+                continue;
+            }
+            if(vendorName == NULL && productName == NULL){  /* name does not matter */
+                break;
             }
+            /* now check whether the names match, unless we did that before.
+             * The device file name contains the address, so it is unique.
+             */
+            if(usbIdentityIsCached(path, 0, vendor, product))
+                break;
+            if((errorCode = checkString(handle, dev->descriptor.iManufacturer, vendorName, "manufacturer")) == 0 &&
+                    (errorCode = checkString(handle, dev->descriptor.iProduct, productName, "product")) == 0){
+                usbCacheIdentity(path, 0, vendor, product);
+                break;
+            }
+            usb_close(handle);
+            handle = NULL;
         }
         if(handle)
             break;
     }
+    usbUnlock();
     if(handle != NULL){
         int rval, retries = 3;
         if(usb_set_configuration(handle, 1)){
@@ -141,37 +176,73 @@ static int          didUsbInit = 0;
 /* Continue anyway, even if we could not claim the interface. Control transfers
  * should still work.
  */
+        if((*device = malloc(sizeof(usbDevice_t))) == NULL){
+            usb_close(handle);
+            return USB_ERROR_IO;
+        }
+        usbInitState(&(*device)->state, _usesReportIDs);
+        (*device)->handle = handle;
         errorCode = 0;
-        *device = handle;
-        usesReportIDs = _usesReportIDs;
     }
     return errorCode;
 }
 
+int usbListDevices(int vendor, int product, char (*locations)[USB_LOCATION_LEN], int maxLocations)
+{
+struct usb_bus      *bus;
+struct usb_device   *dev;
+int                 count = 0;
+
+    usbLock();
+    initUsb();
+    for(bus=usb_get_busses(); bus; bus=bus->next){
+        for(dev=bus->devices; dev && count < maxLocations; dev=dev->next){
+            if(vendor == 0 || (dev->descriptor.idVendor == vendor && dev->descriptor.idProduct == product))
+                snprintf(locations[count++], USB_LOCATION_LEN, "%s/%s", bus->dirname, dev->filename);
+        }
+    }
+    usbUnlock();
+    return count;
+}
+
+/* libusb-0.1 has no hotplug notifications, we poll. */
+int usbWaitForChange(int vendor, int product, int timeoutMs)
+{
+    if(timeoutMs < 0 || timeoutMs > USB_POLL_MS)
+        timeoutMs = USB_POLL_MS;
+    usleep(timeoutMs * 1000);
+    return 0;
+}
+
 /* ------------------------------------------------------------------------- */
 
 void    usbCloseDevice(usbDevice_t *device)
 {
-    if(device != NULL)
-        usb_close(device);
+    if(device != NULL){
+        usb_close(device->handle);
+        free(device);
+    }
 }
 
 /* ------------------------------------------------------------------------- */
 
 int usbSetReport(usbDevice_t *device, int reportType, char *buffer, int len)
 {
-int bytesSent;
+int bytesSent, reportId = buffer[0] & 0xff;
 
-    if(!usesReportIDs){
+    if(!device->state.usesReportIDs){
         buffer++;   /* skip dummy report ID */
         len--;
+        reportId = 0;   /* devices without report IDs expect 0 in wValue */
     }
-    bytesSent = usb_control_msg(device, USB_TYPE_CLASS | USB_RECIP_INTERFACE | USB_ENDPOINT_OUT, USBRQ_HID_SET_REPORT, reportType << 8 | buffer[0], 0, buffer, len, 5000);
+    bytesSent = usb_control_msg(device->handle, USB_TYPE_CLASS | USB_RECIP_INTERFACE | USB_ENDPOINT_OUT, USBRQ_HID_SET_REPORT, reportType << 8 | reportId, 0, buffer, len, device->state.timeoutMs);
     if(bytesSent != len){
         if(bytesSent < 0)
-            fprintf(stderr, "Error sending message: %s\n", usb_strerror());
-        return USB_ERROR_IO;
+            return usbError(&device->state, USB_ERROR_IO, "%s", usb_strerror());
+        return usbError(&device->state, USB_ERROR_IO, "short write (%d of %d bytes)", bytesSent, len);
     }
+    device->state.counters.reportsSent++;
+    device->state.counters.bytesSent += len;
     return 0;
 }
 
@@ -181,23 +252,33 @@ int usbGetReport(usbDevice_t *device, int reportType, int reportNumber, char *bu
 {
 int bytesReceived, maxLen = *len;
 
-    if(!usesReportIDs){
+    if(!device->state.usesReportIDs){
         buffer++;   /* make room for dummy report ID */
         maxLen--;
     }
-    bytesReceived = usb_control_msg(device, USB_TYPE_CLASS | USB_RECIP_INTERFACE | USB_ENDPOINT_IN, USBRQ_HID_GET_REPORT, reportType << 8 | reportNumber, 0, buffer, maxLen, 5000);
-    if(bytesReceived < 0){
-        fprintf(stderr, "Error sending message: %s\n", usb_strerror());
-        return USB_ERROR_IO;
-    }
+    bytesReceived = usb_control_msg(device->handle, USB_TYPE_CLASS | USB_RECIP_INTERFACE | USB_ENDPOINT_IN, USBRQ_HID_GET_REPORT, reportType << 8 | reportNumber, 0, buffer, maxLen, device->state.timeoutMs);
+    if(bytesReceived < 0)
+        return usbError(&device->state, USB_ERROR_IO, "%s", usb_strerror());
+    device->state.counters.reportsReceived++;
+    device->state.counters.bytesReceived += bytesReceived;
     *len = bytesReceived;
-    if(!usesReportIDs){
+    if(!device->state.usesReportIDs){
         buffer[-1] = reportNumber;  /* add dummy report ID */
-        *len++;
+        (*len)++;
     }
     return 0;
 }
 
 /* ------------------------------------------------------------------------- */
 
+int usbSetReportAsync(usbDevice_t *device, int reportType, char *buffer, int len)
+{
+    return usbSetReport(device, reportType, buffer, len);   /* no async support */
+}
 
+int usbFlush(usbDevice_t *device)
+{
+    return 0;
+}
+
+/* ------------------------------------------------------------------------- */
@@ -0,0 +1,453 @@
+/* Name: usb-libusb1.c
+ * Project: usbcalls library
+ * Creation Date: 2026-10-17
+ * Tabsize: 4
+ * Copyright: (c) 2006 by OBJECTIVE DEVELOPMENT Software GmbH
+ * License: Proprietary, free under certain conditions. See Documentation.
+ */
+
+/*
+General Description:
+This module implements USB HID report receiving/sending based on libusb-1.0.
+Like usb-libusb.c, it does not parse the report descriptor and adds a zero
+report ID for devices which don't use report IDs. Whether report IDs are used
+is stored in the device structure.
+
+All devices share one libusb context which is created on first use. The
+completion callback of an asynchronous request may therefore run in any
+thread which handles events. libusb runs callbacks one at a time, so only
+the callback and the thread using the device access the device's async
+state. The callback records a failure and then decrements the pending count
+with atomic operations. The thread using the device turns the failure into
+an error. No locks are taken when reports are sent.
+
+When no location is given, we first try the port at which a device with
+this vendor and product ID was last opened and verified. Only if it is not
+there anymore, we check all devices with matching IDs.
+
+In addition to the synchronous calls, usbSetReportAsync() submits a SET_REPORT
+request and returns immediately. Up to USB_ASYNC_DEPTH requests are queued in
+the kernel so that the next request is already waiting when the previous one
+completes and the bus does not idle between reports.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <libusb.h>
+
+#include "usbcalls.h"
+
+/* ------------------------------------------------------------------------- */
+
+#define USBRQ_HID_GET_REPORT    0x01
+#define USBRQ_HID_SET_REPORT    0x09
+
+#define USB_ASYNC_DEPTH         4   /* max number of queued async requests */
+#define USB_POLL_MS             100 /* poll interval without hotplug support */
+#define USB_EVENT_MS            10  /* max wait if another thread handles events */
+
+struct usbDevice{
+    usbDeviceState_t        state;
+    libusb_device_handle    *handle;
+    int                     pending;    /* async requests not completed yet (atomic) */
+    int                     failed;     /* an async request failed (atomic) */
+    int                     failStatus; /* transfer status of the failed request */
+    int                     failLength; /* bytes transferred, see failExpected */
+    int                     failExpected;
+    int                     asyncError; /* first error, only used by the device's thread */
+};
+
+static libusb_context   *usbContext;
+static int              hotplugEvents;  /* number of hotplug events seen (atomic) */
+
+/* ------------------------------------------------------------------------- */
+
+static int  initUsb(void)
+{
+static int  didUsbInit = 0;
+int         rval = 0;
+
+    usbLock();
+    if(!didUsbInit){
+        if((rval = libusb_init(&usbContext)) != 0){
+            fprintf(stderr, "Error initializing libusb: %s\n", libusb_error_name(rval));
+            rval = USB_ERROR_IO;
+        }else{
+            didUsbInit = 1;
+        }
+    }
+    usbUnlock();
+    return rval;
+}
+
+/* ------------------------------------------------------------------------- */
+
+/* Builds the port path of a device in the same notation as Linux sysfs:
+ * bus number, then the port numbers separated by '.', e.g. "1-1.4".
+ */
+static void devicePath(libusb_device *dev, char *path, int len)
+{
+uint8_t ports[8];
+int     numPorts, i, pos;
+
+    pos = snprintf(path, len, "%d", libusb_get_bus_number(dev));
+    numPorts = libusb_get_port_numbers(dev, ports, sizeof(ports));
+    for(i = 0; i < numPorts && pos < len; i++)
+        pos += snprintf(path + pos, len - pos, "%c%d", i == 0 ? '-' : '.', ports[i]);
+}
+
+/* Compares a string descriptor with 'expected'. Returns 0 if it matches,
+ * USB_ERROR_NOTFOUND if not and USB_ERROR_IO if it can't be read.
+ */
+static int  checkString(libusb_device_handle *handle, int index, char *expected, char *what)
+{
+char    string[256];
+int     len;
+
+    len = libusb_get_string_descriptor_ascii(handle, index, (unsigned char *)string, sizeof(string));
+    if(len < 0){
+        fprintf(stderr, "Warning: cannot query %s for device: %s\n", what, libusb_error_name(len));
+        return USB_ERROR_IO;
+    }
+    string[len] = 0;
+    return strcmp(string, expected) == 0 ? 0 : USB_ERROR_NOTFOUND;
+}
+
+int usbOpenDevice(usbDevice_t **device, int vendor, char *vendorName, int product, char *productName, int usesReportIDs)
+{
+    return usbOpenDeviceAt(device, vendor, vendorName, product, productName, usesReportIDs, NULL, NULL);
+}
+
+/* Looks for a matching device and opens it. If 'location' is not NULL, only
+ * the device at this port is considered.
+ */
+static int  findDevice(libusb_device_handle **handle, int vendor, char *vendorName, int product, char *productName, char *location, char *serial)
+{
+libusb_device                   **list;
+struct libusb_device_descriptor desc;
+ssize_t                         numDevices, i;
+int                             errorCode = USB_ERROR_NOTFOUND, rval, address;
+char                            path[USB_LOCATION_LEN];
+
+    *handle = NULL;
+    if((numDevices = libusb_get_device_list(usbContext, &list)) < 0)
+        return USB_ERROR_IO;
+    for(i = 0; i < numDevices; i++){
+        if(libusb_get_device_descriptor(list[i], &desc) != 0)
+            continue;
+        if(desc.idVendor != vendor || desc.idProduct != product)
+            continue;
+        devicePath(list[i], path, sizeof(path));
+        if(location != NULL && strcmp(path, location) != 0)
+            continue;   /* no need to open devices at other ports */
+        if((rval = libusb_open(list[i], handle)) != 0){    /* we need to open the device in order to query strings */
+            errorCode = USB_ERROR_ACCESS;
+            fprintf(stderr, "Warning: cannot open USB device: %s\n", libusb_error_name(rval));
+            *handle = NULL;
+            continue;
+        }
+        if(serial != NULL && (errorCode = checkString(*handle, desc.iSerialNumber, serial, "serial number")) != 0){
+            libusb_close(*handle);
+            *handle = NULL;
+            continue;
+        }
+        if(vendorName == NULL || productName == NULL)   /* name does not matter */
+            break;
+        /* now check whether the names match, unless we did that before: */
+        address = libusb_get_device_address(list[i]);
+        usbLock();
+        rval = usbIdentityIsCached(path, address, vendor, product);
+        usbUnlock();
+        if(rval)
+            break;
+        if((errorCode = checkString(*handle, desc.iManufacturer, vendorName, "manufacturer")) == 0 &&
+                (errorCode = checkString(*handle, desc.iProduct, productName, "product")) == 0){
+            usbLock();
+            usbCacheIdentity(path, address, vendor, product);
+            usbUnlock();
+            break;
+        }
+        libusb_close(*handle);
+        *handle = NULL;
+    }
+    libusb_free_device_list(list, 1);
+    return *handle != NULL ? 0 : errorCode;
+}
+
+int usbOpenDeviceAt(usbDevice_t **device, int vendor, char *vendorName, int product, char *productName, int usesReportIDs, char *location, char *serial)
+{
+libusb_device_handle    *handle = NULL;
+int                     errorCode = USB_ERROR_NOTFOUND, rval, haveCached = 0;
+char                    path[USB_LOCATION_LEN];
+
+    if((rval = initUsb()) != 0)
+        return rval;
+    if(location == NULL){   /* try the port where we found it last time */
+        usbLock();
+        haveCached = usbCachedLocation(vendor, product, path);
+        usbUnlock();
+        if(haveCached)
+            errorCode = findDevice(&handle, vendor, vendorName, product, productName, path, serial);
+    }
+    if(handle == NULL)
+        errorCode = findDevice(&handle, vendor, vendorName, product, productName, location, serial);
+    if(handle != NULL){
+        /* Let libusb detach the kernel HID driver while we hold the interface
+         * and reattach it on close. Not all platforms support this.
+         */
+        libusb_set_auto_detach_kernel_driver(handle, 1);
+        if((rval = libusb_claim_interface(handle, 0)) != 0){
+#ifndef __APPLE__
+            fprintf(stderr, "Warning: could not claim interface: %s\n", libusb_error_name(rval));
+#endif
+        }
+/* Continue anyway, even if we could not claim the interface. Control transfers
+ * should still work.
+ */
+        if((*device = calloc(1, sizeof(usbDevice_t))) == NULL){
+            libusb_close(handle);
+            return USB_ERROR_IO;
+        }
+        usbInitState(&(*device)->state, usesReportIDs);
+        (*device)->handle = handle;
+        return 0;
+    }
+    return errorCode;
+}
+
+int usbListDevices(int vendor, int product, char (*locations)[USB_LOCATION_LEN], int maxLocations)
+{
+libusb_device                   **list;
+struct libusb_device_descriptor desc;
+ssize_t                         numDevices, i;
+int                             count = 0;
+
+    if(initUsb() != 0 || (numDevices = libusb_get_device_list(usbContext, &list)) < 0)
+        return 0;
+    for(i = 0; i < numDevices && count < maxLocations; i++){
+        if(libusb_get_device_descriptor(list[i], &desc) != 0)
+            continue;
+        if(vendor == 0 || (desc.idVendor == vendor && desc.idProduct == product))
+            devicePath(list[i], locations[count++], USB_LOCATION_LEN);
+    }
+    libusb_free_device_list(list, 1);
+    return count;
+}
+
+/* ------------------------------------------------------------------------- */
+
+static int LIBUSB_CALL  hotplugCallback(libusb_context *context, libusb_device *dev, libusb_hotplug_event event, void *userData)
+{
+    __atomic_add_fetch(&hotplugEvents, 1, __ATOMIC_RELEASE);
+    return 0;   /* stay registered */
+}
+
+/* Waits one poll interval, but not longer than 'timeoutMs'. */
+static void pollDelay(int timeoutMs)
+{
+    if(timeoutMs < 0 || timeoutMs > USB_POLL_MS)
+        timeoutMs = USB_POLL_MS;
+    usleep(timeoutMs * 1000);
+}
+
+/* The callback stays registered once installed, so that libusb queues events
+ * which occur while the caller scans for devices and none are lost.
+ */
+int usbWaitForChange(int vendor, int product, int timeoutMs)
+{
+static int                      registered = 0; /* -1 if registration failed */
+libusb_hotplug_callback_handle  handle;
+struct timeval                  tv;
+int                             rval, seen = __atomic_load_n(&hotplugEvents, __ATOMIC_ACQUIRE), isNew = 0;
+
+    if((rval = initUsb()) != 0)
+        return rval;
+    usbLock();
+    if(registered == 0){
+        registered = -1;
+        if(!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)){
+            /* we poll */
+        }else if((rval = libusb_hotplug_register_callback(usbContext, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT, LIBUSB_HOTPLUG_NO_FLAGS, vendor, product, LIBUSB_HOTPLUG_MATCH_ANY, hotplugCallback, NULL, &handle)) != 0){
+            fprintf(stderr, "Warning: cannot register hotplug callback: %s\n", libusb_error_name(rval));
+        }else{
+            registered = 1;
+            isNew = 1;
+        }
+    }
+    usbUnlock();
+    if(isNew)
+        return 0;   /* the device may have arrived before we registered */
+    if(registered < 0){
+        pollDelay(timeoutMs);
+        return 0;
+    }
+    while(__atomic_load_n(&hotplugEvents, __ATOMIC_ACQUIRE) == seen){
+        if(timeoutMs >= 0){
+            tv.tv_sec = timeoutMs / 1000;
+            tv.tv_usec = (timeoutMs % 1000) * 1000;
+        }else{
+            tv.tv_sec = 3600;
+            tv.tv_usec = 0;
+        }
+        if((rval = libusb_handle_events_timeout_completed(usbContext, &tv, NULL)) != 0 && rval != LIBUSB_ERROR_INTERRUPTED)
+            return USB_ERROR_IO;
+        if(timeoutMs >= 0)
+            break;
+    }
+    return 0;
+}
+
+/* ------------------------------------------------------------------------- */
+
+void    usbCloseDevice(usbDevice_t *device)
+{
+    if(device != NULL){
+        usbFlush(device);
+        libusb_release_interface(device->handle, 0);
+        libusb_close(device->handle);
+        free(device);
+    }
+}
+
+/* ------------------------------------------------------------------------- */
+
+int usbSetReport(usbDevice_t *device, int reportType, char *buffer, int len)
+{
+int bytesSent, reportId = buffer[0] & 0xff;
+
+    if(!device->state.usesReportIDs){
+        buffer++;   /* skip dummy report ID */
+        len--;
+        reportId = 0;   /* devices without report IDs expect 0 in wValue */
+    }
+    bytesSent = libusb_control_transfer(device->handle, LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE | LIBUSB_ENDPOINT_OUT, USBRQ_HID_SET_REPORT, reportType << 8 | reportId, 0, (unsigned char *)buffer, len, device->state.timeoutMs);
+    if(bytesSent != len){
+        if(bytesSent < 0)
+            return usbError(&device->state, USB_ERROR_IO, "%s", libusb_error_name(bytesSent));
+        return usbError(&device->state, USB_ERROR_IO, "short write (%d of %d bytes)", bytesSent, len);
+    }
+    device->state.counters.reportsSent++;
+    device->state.counters.bytesSent += len;
+    return 0;
+}
+
+/* ------------------------------------------------------------------------- */
+
+int usbGetReport(usbDevice_t *device, int reportType, int reportNumber, char *buffer, int *len)
+{
+int bytesReceived, maxLen = *len;
+
+    if(!device->state.usesReportIDs){
+        buffer++;   /* make room for dummy report ID */
+        maxLen--;
+    }
+    bytesReceived = libusb_control_transfer(device->handle, LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE | LIBUSB_ENDPOINT_IN, USBRQ_HID_GET_REPORT, reportType << 8 | reportNumber, 0, (unsigned char *)buffer, maxLen, device->state.timeoutMs);
+    if(bytesReceived < 0)
+        return usbError(&device->state, USB_ERROR_IO, "%s", libusb_error_name(bytesReceived));
+    device->state.counters.reportsReceived++;
+    device->state.counters.bytesReceived += bytesReceived;
+    *len = bytesReceived;
+    if(!device->state.usesReportIDs){
+        buffer[-1] = reportNumber;  /* add dummy report ID */
+        (*len)++;
+    }
+    return 0;
+}
+
+/* ------------------------------------------------------------------------- */
+
+static void LIBUSB_CALL asyncCallback(struct libusb_transfer *transfer)
+{
+usbDevice_t *device = transfer->user_data;
+int         expected = transfer->length - LIBUSB_CONTROL_SETUP_SIZE;
+
+    if(!__atomic_load_n(&device->failed, __ATOMIC_RELAXED) && (transfer->status != LIBUSB_TRANSFER_COMPLETED || transfer->actual_length != expected)){
+        device->failStatus = transfer->status;
+        device->failLength = transfer->actual_length;
+        device->failExpected = expected;
+        __atomic_store_n(&device->failed, 1, __ATOMIC_RELEASE);
+    }
+    __atomic_sub_fetch(&device->pending, 1, __ATOMIC_RELEASE);
+    /* buffer and transfer are freed by libusb (LIBUSB_TRANSFER_FREE_*) */
+}
+
+/* Turns the failure recorded by asyncCallback() into an error. */
+static void collectAsyncError(usbDevice_t *device)
+{
+    if(device->asyncError != 0 || !__atomic_load_n(&device->failed, __ATOMIC_ACQUIRE))
+        return;
+    if(device->failStatus != LIBUSB_TRANSFER_COMPLETED){
+        device->asyncError = usbError(&device->state, USB_ERROR_IO, "transfer status %d", device->failStatus);
+    }else{
+        device->asyncError = usbError(&device->state, USB_ERROR_IO, "short write (%d of %d bytes)", device->failLength, device->failExpected);
+    }
+}
+
+/* Processes events until at most 'maxPending' requests are outstanding.
+ * Another thread may handle the completion of our request just before we
+ * wait, so we wait at most USB_EVENT_MS and check again.
+ */
+static void waitPending(usbDevice_t *device, int maxPending)
+{
+struct timeval  tv;
+int             rval;
+
+    while(__atomic_load_n(&device->pending, __ATOMIC_ACQUIRE) > maxPending){
+        tv.tv_sec = 0;
+        tv.tv_usec = USB_EVENT_MS * 1000;
+        rval = libusb_handle_events_timeout_completed(usbContext, &tv, NULL);
+        if(rval != 0 && rval != LIBUSB_ERROR_INTERRUPTED && device->asyncError == 0)
+            device->asyncError = usbError(&device->state, USB_ERROR_IO, "%s", libusb_error_name(rval));
+    }
+    collectAsyncError(device);
+}
+
+int usbSetReportAsync(usbDevice_t *device, int reportType, char *buffer, int len)
+{
+struct libusb_transfer  *transfer;
+unsigned char           *data;
+int                     rval, reportId = buffer[0] & 0xff;
+
+    waitPending(device, USB_ASYNC_DEPTH - 1);
+    if(device->asyncError != 0)
+        return device->asyncError;
+    if(!device->state.usesReportIDs){
+        buffer++;   /* skip dummy report ID */
+        len--;
+        reportId = 0;   /* devices without report IDs expect 0 in wValue */
+    }
+    if((transfer = libusb_alloc_transfer(0)) == NULL)
+        return usbError(&device->state, USB_ERROR_IO, "out of memory");
+    if((data = malloc(LIBUSB_CONTROL_SETUP_SIZE + len)) == NULL){
+        libusb_free_transfer(transfer);
+        return usbError(&device->state, USB_ERROR_IO, "out of memory");
+    }
+    libusb_fill_control_setup(data, LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE | LIBUSB_ENDPOINT_OUT, USBRQ_HID_SET_REPORT, reportType << 8 | reportId, 0, len);
+    memcpy(data + LIBUSB_CONTROL_SETUP_SIZE, buffer, len);
+    libusb_fill_control_transfer(transfer, device->handle, data, asyncCallback, device, device->state.timeoutMs);
+    transfer->flags = LIBUSB_TRANSFER_FREE_BUFFER | LIBUSB_TRANSFER_FREE_TRANSFER;
+    __atomic_add_fetch(&device->pending, 1, __ATOMIC_RELAXED);  /* before the callback can run */
+    if((rval = libusb_submit_transfer(transfer)) != 0){
+        __atomic_sub_fetch(&device->pending, 1, __ATOMIC_RELAXED);
+        libusb_free_transfer(transfer);     /* also frees the buffer */
+        return usbError(&device->state, USB_ERROR_IO, "%s", libusb_error_name(rval));
+    }
+    device->state.counters.reportsSent++;
+    device->state.counters.bytesSent += len;
+    return 0;
+}
+
+int usbFlush(usbDevice_t *device)
+{
+int rval;
+
+    waitPending(device, 0);
+    rval = device->asyncError;
+    device->asyncError = 0;
+    __atomic_store_n(&device->failed, 0, __ATOMIC_RELAXED);  /* no callback is pending */
+    return rval;
+}
+
+/* ------------------------------------------------------------------------- */
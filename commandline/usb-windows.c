@@ -17,6 +17,7 @@ hidsdi.h.
 */
 
 #include <stdio.h>
+#include <string.h>
 #include <windows.h>
 #include <setupapi.h>
 #include "hidsdi.h"
@@ -30,6 +31,15 @@ hidsdi.h.
 #define DEBUG_PRINT(arg)
 #endif
 
+#define USB_POLL_MS 100 /* poll interval for usbWaitForChange() */
+
+struct usbDevice{
+    usbDeviceState_t    state;
+    HANDLE              handle;
+    unsigned short      featureLength[256]; /* by report ID, 0 if unknown */
+    int                 maxFeatureLength;   /* buffer size Windows requires */
+};
+
 /* ------------------------------------------------------------------------ */
 
 static void convertUniToAscii(char *buffer)
@@ -47,7 +57,52 @@ char            *ascii = buffer;
     *ascii++ = 0;
 }
 
+/* HidD_GetFeature() does not tell us how many bytes the device has sent, it
+ * always fills the entire buffer. We therefore compute the length of each
+ * feature report from the report descriptor. Our devices declare all reports
+ * as arrays of values, we don't count buttons.
+ * Returns the length of the longest feature report, 0 if unknown.
+ */
+static int  getFeatureLengths(HANDLE handle, unsigned short *lengths)
+{
+PHIDP_PREPARSED_DATA    preparsed;
+HIDP_CAPS               caps;
+HIDP_VALUE_CAPS         *valueCaps;
+USHORT                  numCaps;
+unsigned long           bits[256];
+int                     i, maxLength = 0;
+
+    memset(bits, 0, sizeof(bits));
+    memset(lengths, 0, 256 * sizeof(lengths[0]));
+    if(!HidD_GetPreparsedData(handle, &preparsed))
+        return 0;
+    if(HidP_GetCaps(preparsed, &caps) == HIDP_STATUS_SUCCESS && (numCaps = caps.NumberFeatureValueCaps) > 0){
+        maxLength = caps.FeatureReportByteLength;
+        if((valueCaps = malloc(numCaps * sizeof(*valueCaps))) != NULL){
+            if(HidP_GetValueCaps(HidP_Feature, valueCaps, &numCaps, preparsed) == HIDP_STATUS_SUCCESS){
+                for(i = 0; i < numCaps; i++)
+                    bits[valueCaps[i].ReportID] += (unsigned long)valueCaps[i].BitSize * valueCaps[i].ReportCount;
+            }
+            free(valueCaps);
+        }
+    }
+    HidD_FreePreparsedData(preparsed);
+    for(i = 0; i < 256; i++){
+        if(bits[i] != 0)
+            lengths[i] = (bits[i] + 7) / 8 + 1;     /* add the report ID byte */
+    }
+    return maxLength;
+}
+
 int usbOpenDevice(usbDevice_t **device, int vendor, char *vendorName, int product, char *productName, int usesReportIDs)
+{
+    return usbOpenDeviceAt(device, vendor, vendorName, product, productName, usesReportIDs, NULL, NULL);
+}
+
+/* The location is the device interface path. Since Windows has no notion of
+ * a device address, we don't use the identity cache.
+ */
+int usbOpenDeviceAt(usbDevice_t **device, int vendor, char *vendorName, int product, char *productName, int usesReportIDs, char *location, char *serial)
 {
 GUID                                hidGuid;        /* GUID for HID driver */
 HDEVINFO                            deviceInfoList;
@@ -78,6 +133,8 @@ HIDD_ATTRIBUTES                     deviceAttributes;
         /* this call is for real: */
         SetupDiGetDeviceInterfaceDetail(deviceInfoList, &deviceInfo, deviceDetails, size, &size, NULL);
         DEBUG_PRINT(("checking HID path \"%s\"\n", deviceDetails->DevicePath));
+        if(location != NULL && _stricmp(deviceDetails->DevicePath, location) != 0)
+            continue;   /* don't open devices at other locations */
         /* attempt opening for R/W -- we don't care about devices which can't be accessed */
         handle = CreateFile(deviceDetails->DevicePath, GENERIC_READ|GENERIC_WRITE, FILE_SHARE_READ|FILE_SHARE_WRITE, NULL, OPEN_EXISTING, openFlag, NULL);
         if(handle == INVALID_HANDLE_VALUE){
@@ -91,6 +148,17 @@ HIDD_ATTRIBUTES                     deviceAttributes;
         if(deviceAttributes.VendorID != vendor || deviceAttributes.ProductID != product)
             continue;   /* ignore this device */
         errorCode = USB_ERROR_NOTFOUND;
+        if(serial != NULL){
+            char    buffer[512];
+            if(!HidD_GetSerialNumberString(handle, buffer, sizeof(buffer))){
+                DEBUG_PRINT(("error obtaining serial number\n"));
+                errorCode = USB_ERROR_IO;
+                continue;
+            }
+            convertUniToAscii(buffer);
+            if(strcmp(serial, buffer) != 0)
+                continue;
+        }
         if(vendorName != NULL && productName != NULL){
             char    buffer[512];
             if(!HidD_GetManufacturerString(handle, buffer, sizeof(buffer))){
@@ -118,26 +186,100 @@ HIDD_ATTRIBUTES                     deviceAttributes;
     if(deviceDetails != NULL)
         free(deviceDetails);
     if(handle != INVALID_HANDLE_VALUE){
-        *device = (usbDevice_t *)handle;
+        if((*device = malloc(sizeof(usbDevice_t))) == NULL){
+            CloseHandle(handle);
+            return USB_ERROR_IO;
+        }
+        usbInitState(&(*device)->state, usesReportIDs);
+        (*device)->handle = handle;
+        (*device)->maxFeatureLength = getFeatureLengths(handle, (*device)->featureLength);
         errorCode = 0;
     }
     return errorCode;
 }
 
+int usbListDevices(int vendor, int product, char (*locations)[USB_LOCATION_LEN], int maxLocations)
+{
+GUID                                hidGuid;
+HDEVINFO                            deviceInfoList;
+SP_DEVICE_INTERFACE_DATA            deviceInfo;
+SP_DEVICE_INTERFACE_DETAIL_DATA     *deviceDetails;
+DWORD                               size;
+HANDLE                              handle;
+HIDD_ATTRIBUTES                     deviceAttributes;
+int                                 i, count = 0;
+
+    HidD_GetHidGuid(&hidGuid);
+    deviceInfoList = SetupDiGetClassDevs(&hidGuid, NULL, NULL, DIGCF_PRESENT | DIGCF_INTERFACEDEVICE);
+    deviceInfo.cbSize = sizeof(deviceInfo);
+    for(i=0; count < maxLocations; i++){
+        if(!SetupDiEnumDeviceInterfaces(deviceInfoList, 0, &hidGuid, i, &deviceInfo))
+            break;  /* no more entries */
+        SetupDiGetDeviceInterfaceDetail(deviceInfoList, &deviceInfo, NULL, 0, &size, NULL);
+        if((deviceDetails = malloc(size)) == NULL)
+            break;
+        deviceDetails->cbSize = sizeof(*deviceDetails);
+        SetupDiGetDeviceInterfaceDetail(deviceInfoList, &deviceInfo, deviceDetails, size, &size, NULL);
+        /* no access rights are needed to query the attributes */
+        handle = CreateFile(deviceDetails->DevicePath, 0, FILE_SHARE_READ|FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL);
+        if(handle != INVALID_HANDLE_VALUE){
+            deviceAttributes.Size = sizeof(deviceAttributes);
+            if(HidD_GetAttributes(handle, &deviceAttributes) && (vendor == 0 || (deviceAttributes.VendorID == vendor && deviceAttributes.ProductID == product))){
+                strncpy(locations[count], deviceDetails->DevicePath, USB_LOCATION_LEN - 1);
+                locations[count++][USB_LOCATION_LEN - 1] = 0;
+            }
+            CloseHandle(handle);
+        }
+        free(deviceDetails);
+    }
+    SetupDiDestroyDeviceInfoList(deviceInfoList);
+    return count;
+}
+
+/* We poll instead of registering for device notifications, which would
+ * require a window and a message loop.
+ */
+int usbWaitForChange(int vendor, int product, int timeoutMs)
+{
+    if(timeoutMs < 0 || timeoutMs > USB_POLL_MS)
+        timeoutMs = USB_POLL_MS;
+    Sleep(timeoutMs);
+    return 0;
+}
+
 /* ------------------------------------------------------------------------ */
 
 void    usbCloseDevice(usbDevice_t *device)
 {
-    CloseHandle((HANDLE)device);
+    if(device != NULL){
+        CloseHandle(device->handle);
+        free(device);
+    }
 }
 
 /* ------------------------------------------------------------------------ */
 
+/* Windows rejects feature report buffers which are shorter than the longest
+ * feature report of the device. Returns a zero padded copy of 'buffer' if
+ * necessary, which the caller must free, or 'buffer' itself.
+ */
+static char *padFeatureBuffer(usbDevice_t *device, char *buffer, int len)
+{
+char    *padded;
+
+    if(len >= device->maxFeatureLength)
+        return buffer;
+    if((padded = calloc(1, device->maxFeatureLength)) != NULL)
+        memcpy(padded, buffer, len);
+    return padded;
+}
+
 int usbSetReport(usbDevice_t *device, int reportType, char *buffer, int len)
 {
-HANDLE  handle = (HANDLE)device;
+HANDLE  handle = device->handle;
 BOOLEAN rval = 0;
 DWORD   bytesWritten;
+char    *padded;
 
     switch(reportType){
     case USB_HID_REPORT_TYPE_INPUT:
@@ -146,19 +288,28 @@ DWORD   bytesWritten;
         rval = WriteFile(handle, buffer, len, &bytesWritten, NULL);
         break;
     case USB_HID_REPORT_TYPE_FEATURE:
-        rval = HidD_SetFeature(handle, buffer, len);
+        if((padded = padFeatureBuffer(device, buffer, len)) == NULL)
+            return usbError(&device->state, USB_ERROR_IO, "out of memory");
+        rval = HidD_SetFeature(handle, padded, len > device->maxFeatureLength ? len : device->maxFeatureLength);
+        if(padded != buffer)
+            free(padded);
         break;
     }
-    return rval == 0 ? USB_ERROR_IO : 0;
+    if(rval == 0)
+        return usbError(&device->state, USB_ERROR_IO, "Windows error %lu", (unsigned long)GetLastError());
+    device->state.counters.reportsSent++;
+    device->state.counters.bytesSent += len;
+    return 0;
 }
 
 /* ------------------------------------------------------------------------ */
 
 int usbGetReport(usbDevice_t *device, int reportType, int reportNumber, char *buffer, int *len)
 {
-HANDLE  handle = (HANDLE)device;
+HANDLE  handle = device->handle;
 BOOLEAN rval = 0;
 DWORD   bytesRead;
+char    *padded;
 
     switch(reportType){
     case USB_HID_REPORT_TYPE_INPUT:
@@ -171,10 +322,34 @@ DWORD   bytesRead;
         break;
     case USB_HID_REPORT_TYPE_FEATURE:
         buffer[0] = reportNumber;
-        rval = HidD_GetFeature(handle, buffer, *len);
+        if((padded = padFeatureBuffer(device, buffer, *len)) == NULL)
+            return usbError(&device->state, USB_ERROR_IO, "out of memory");
+        rval = HidD_GetFeature(handle, padded, *len > device->maxFeatureLength ? *len : device->maxFeatureLength);
+        if(padded != buffer){
+            memcpy(buffer, padded, *len);
+            free(padded);
+        }
+        if(rval && device->featureLength[reportNumber & 0xff] != 0 && device->featureLength[reportNumber & 0xff] < *len)
+            *len = device->featureLength[reportNumber & 0xff];
         break;
     }
-    return rval == 0 ? USB_ERROR_IO : 0;
+    if(rval == 0)
+        return usbError(&device->state, USB_ERROR_IO, "Windows error %lu", (unsigned long)GetLastError());
+    device->state.counters.reportsReceived++;
+    device->state.counters.bytesReceived += *len;
+    return 0;
+}
+
+/* ------------------------------------------------------------------------ */
+
+int usbSetReportAsync(usbDevice_t *device, int reportType, char *buffer, int len)
+{
+    return usbSetReport(device, reportType, buffer, len);   /* no async support */
+}
+
+int usbFlush(usbDevice_t *device)
+{
+    return 0;
 }
 
 /* ------------------------------------------------------------------------ */
@@ -12,9 +12,152 @@
  * specific defines.
  */
 
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include "usbcalls.h"
+
+/* Per device state which is common to all implementations. Each
+ * implementation has a member 'state' of this type in its struct usbDevice.
+ */
+typedef struct usbDeviceState{
+    int             usesReportIDs;
+    int             timeoutMs;
+    usbCounters_t   counters;
+    char            errorText[128];
+}usbDeviceState_t;
+
+static void usbInitState(usbDeviceState_t *state, int usesReportIDs);
+static int  usbError(usbDeviceState_t *state, int errCode, char *format, ...);
+int usbIdentityIsCached(char *location, int address, int vendor, int product);
+void    usbCacheIdentity(char *location, int address, int vendor, int product);
+int usbCachedLocation(int vendor, int product, char *location);
+/* Implemented below, shared by all implementations. */
+
+#if defined(WIN32)
+/* The Windows implementation has no global state which needs protection. */
+#   define usbLock()
+#   define usbUnlock()
+#else
+#   include <pthread.h>
+static pthread_mutex_t  usbMutex = PTHREAD_MUTEX_INITIALIZER;
+#   define usbLock()    pthread_mutex_lock(&usbMutex)
+#   define usbUnlock()  pthread_mutex_unlock(&usbMutex)
+#endif
+/* Protects library initialization and other global state. Must not be used
+ * in the transfer functions.
+ */
+
 #if defined(WIN32)
 #   include "usb-windows.c"
+#elif defined(USE_HIDRAW)
+#   include "usb-hidraw.c"
+#elif defined(USE_LIBUSB1)
+#   include "usb-libusb1.c"
 #else
 /* e.g. defined(__APPLE__) */
 #   include "usb-libusb.c"
 #endif
+
+/* ------------------------------------------------------------------------- */
+
+static void usbInitState(usbDeviceState_t *state, int usesReportIDs)
+{
+    memset(state, 0, sizeof(*state));
+    state->usesReportIDs = usesReportIDs;
+    state->timeoutMs = USB_DEFAULT_TIMEOUT;
+}
+
+/* Records the description of an error in the device state and returns
+ * 'errCode'.
+ */
+static int  usbError(usbDeviceState_t *state, int errCode, char *format, ...)
+{
+va_list args;
+
+    va_start(args, format);
+    vsnprintf(state->errorText, sizeof(state->errorText), format, args);
+    va_end(args);
+    state->counters.errors++;
+    return errCode;
+}
+
+void    usbSetTimeout(usbDevice_t *device, int timeoutMs)
+{
+    device->state.timeoutMs = timeoutMs;
+}
+
+void    usbGetCounters(usbDevice_t *device, usbCounters_t *counters)
+{
+    *counters = device->state.counters;
+}
+
+char    *usbLastError(usbDevice_t *device)
+{
+    return device->state.errorText;
+}
+
+/* ------------------------------------------------------------------------- */
+
+/* Cache of devices whose manufacturer and product names have been verified.
+ * A device is identified by its port path and the address assigned by the
+ * host. The address changes whenever the device re-enumerates, so a different
+ * device plugged into the same port is verified again.
+ * The caller must hold the lock (see usbLock()) when using the cache.
+ */
+#define USB_IDENTITY_CACHE_SIZE 16
+
+typedef struct usbIdentity{
+    char    location[USB_LOCATION_LEN];
+    int     address;
+    int     vendor;
+    int     product;
+}usbIdentity_t;
+
+static usbIdentity_t    identityCache[USB_IDENTITY_CACHE_SIZE];
+static int              identityCacheNext;
+
+int usbIdentityIsCached(char *location, int address, int vendor, int product)
+{
+int i;
+
+    for(i = 0; i < USB_IDENTITY_CACHE_SIZE; i++){
+        usbIdentity_t *id = &identityCache[i];
+        if(id->address == address && id->vendor == vendor && id->product == product && strcmp(id->location, location) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+void    usbCacheIdentity(char *location, int address, int vendor, int product)
+{
+usbIdentity_t   *id = &identityCache[identityCacheNext];
+
+    identityCacheNext = (identityCacheNext + 1) % USB_IDENTITY_CACHE_SIZE;
+    strncpy(id->location, location, sizeof(id->location) - 1);
+    id->location[sizeof(id->location) - 1] = 0;
+    id->address = address;
+    id->vendor = vendor;
+    id->product = product;
+}
+
+/* Copies the location of the device with this vendor and product ID which
+ * was cached last to 'location' (USB_LOCATION_LEN bytes). Returns 1 if there
+ * is one, 0 otherwise.
+ */
+int usbCachedLocation(int vendor, int product, char *location)
+{
+int i, n;
+
+    for(i = 1; i <= USB_IDENTITY_CACHE_SIZE; i++){
+        n = (identityCacheNext + USB_IDENTITY_CACHE_SIZE - i) % USB_IDENTITY_CACHE_SIZE;
+        if(identityCache[n].vendor == vendor && identityCache[n].product == product && identityCache[n].location[0] != 0){
+            strcpy(location, identityCache[n].location);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* ------------------------------------------------------------------------- */
+
@@ -15,7 +15,11 @@
 General Description:
 This module implements an abstraction layer for access to USB/HID communication
 functions. An implementation based on libusb (portable to Linux, FreeBSD and
-Mac OS X) and a native implementation for Windows are provided.
+Mac OS X) and a native implementation for Windows are provided. Define
+USE_LIBUSB1 to use the libusb-1.0 implementation instead of the one for the
+legacy libusb-0.1 API. On Linux, USE_HIDRAW selects an implementation based
+on the hidraw driver which does not need libusb at all.
+All functions may be called from several threads.
 */
 
 /* ------------------------------------------------------------------------ */
@@ -34,13 +38,33 @@ Mac OS X) and a native implementation for Windows are provided.
  * module.
  */
 
+#define USB_DEFAULT_TIMEOUT 5000
+/* Default timeout for transfers in milliseconds, see usbSetTimeout(). */
+
+#define USB_LOCATION_LEN    256
+/* Maximum length of a port path (see usbOpenDeviceAt()) including the
+ * terminating null byte.
+ */
+
 /* ------------------------------------------------------------------------ */
 
 typedef struct usbDevice    usbDevice_t;
 /* This type represents a USB device internally. Only opaque pointers to this
- * type are available outside the module implementation.
+ * type are available outside the module implementation. All state which
+ * belongs to a device is stored here, so different devices may be used from
+ * different threads at the same time. A single device must not be used by
+ * more than one thread at a time.
  */
 
+typedef struct usbCounters{
+    unsigned long   reportsSent;
+    unsigned long   reportsReceived;
+    unsigned long   bytesSent;
+    unsigned long   bytesReceived;
+    unsigned long   errors;
+}usbCounters_t;
+/* Transfer statistics of a device, see usbGetCounters(). */
+
 /* ------------------------------------------------------------------------ */
 
 int usbOpenDevice(usbDevice_t **device, int vendor, char *vendorName, int product, char *productName, int usesReportIDs);
@@ -54,6 +78,35 @@ int usbOpenDevice(usbDevice_t **device, int vendor, char *vendorName, int produc
  * must be closed with usbCloseDevice(). If the device has not been found or
  * opening failed, an error code is returned.
  */
+int usbOpenDeviceAt(usbDevice_t **device, int vendor, char *vendorName, int product, char *productName, int usesReportIDs, char *location, char *serial);
+/* This function is equivalent to usbOpenDevice(), but accepts only the device
+ * at the port path 'location' if it is not NULL and only a device with serial
+ * number 'serial' if that is not NULL. Devices at other locations are not
+ * opened at all. The port path is the name of the device in
+ * /sys/bus/usb/devices on Linux (e.g. "1-1.4") for the hidraw and libusb-1.0
+ * implementations, "<bus>/<device>" as listed by lsusb for libusb-0.1 and the
+ * HID device interface path on Windows. Manufacturer and product names are
+ * checked only the first time a device is opened at a location, later opens
+ * of the same device are answered from a cache.
+ * Returns: see usbOpenDevice().
+ */
+int usbListDevices(int vendor, int product, char (*locations)[USB_LOCATION_LEN], int maxLocations);
+/* This function stores the port paths (see usbOpenDeviceAt()) of up to
+ * 'maxLocations' connected devices with the given Vendor-ID and Product-ID in
+ * 'locations'. If 'vendor' is 0, all devices are listed (on Windows and with
+ * hidraw only HID devices). The devices are not opened, their names are not
+ * checked.
+ * Returns: the number of port paths stored.
+ */
+int usbWaitForChange(int vendor, int product, int timeoutMs);
+/* This function waits until a device with the given Vendor-ID and Product-ID
+ * is connected or disconnected, but at most 'timeoutMs' milliseconds. A
+ * negative timeout waits forever. Hotplug notifications are used where
+ * available, otherwise the function returns after a short poll interval. It
+ * may also return early for other reasons, so callers must scan for devices
+ * again and check their own deadline after each call.
+ * Returns: 0 on success, an error code otherwise.
+ */
 void    usbCloseDevice(usbDevice_t *device);
 /* Every device opened with usbOpenDevice() must be closed with this function.
  */
@@ -75,6 +128,35 @@ int usbGetReport(usbDevice_t *device, int reportType, int reportID, char *buffer
  * in '*len'.
  * Returns: 0 on success, an error code otherwise.
  */
+int usbSetReportAsync(usbDevice_t *device, int reportType, char *buffer, int len);
+/* This function is equivalent to usbSetReport(), except that it may return
+ * before the report has been sent. The data is copied, so 'buffer' may be
+ * reused immediately. Reports are sent in the order of submission. Errors are
+ * reported by a later call to usbSetReportAsync() or by usbFlush().
+ * Implementations without asynchronous transfers send the report right away.
+ * Returns: 0 on success, an error code if this or a previous asynchronous
+ * report failed.
+ */
+int usbFlush(usbDevice_t *device);
+/* This function waits until all reports submitted with usbSetReportAsync()
+ * have been sent.
+ * Returns: 0 on success, an error code if one of the reports failed.
+ */
+void    usbSetTimeout(usbDevice_t *device, int timeoutMs);
+/* This function sets the timeout for transfers of this device. The default
+ * is USB_DEFAULT_TIMEOUT. The hidraw and Windows implementations use the
+ * timeouts of the operating system instead.
+ */
+void    usbGetCounters(usbDevice_t *device, usbCounters_t *counters);
+/* This function copies the transfer statistics of the device to '*counters'.
+ * A report counts as sent when it has been submitted.
+ */
+char    *usbLastError(usbDevice_t *device);
+/* This function returns the description of the last error of the device as
+ * reported by the operating system or the USB library. An empty string is
+ * returned if there was no error. The text is stored in the device
+ * structure and remains valid until the device is closed.
+ */
 
 /* ------------------------------------------------------------------------ */
 
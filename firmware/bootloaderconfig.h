@@ -105,6 +105,124 @@ these macros are defined, the boot loader usees them.
  * an example: http://git.lochraster.org:2080/?p=fd0/usbload;a=tree
  */
 
+#define BOOTLOADER_EXIT_DELAY   2
+/* After the exit request (BOOTLOADER_CAN_EXIT), the boot loader waits until
+ * the host has received the status stage and then this many milliseconds
+ * (0 ... 255) before it disconnects and starts the application. This gives
+ * the host time to complete the transfer. If the status stage is not fetched
+ * within 100 ms, the boot loader leaves anyway.
+ */
+
+/* The options below are off by default. Check the size of main.hex with
+ * avr-size when you enable options and select a larger boot section
+ * (BOOTLOADER_ADDRESS in the Makefile and the BOOTSZ fuse bits) if necessary.
+ */
+
+#define BOOTLOADER_CAN_ERASE    0
+/* If this macro is defined to 1, the host can erase the entire application
+ * section (everything below BOOTLOADER_ADDRESS) with a single request. The
+ * command line tool then skips pages which contain only 0xff instead of
+ * sending them. If you define it to 0, pages are only erased when data is
+ * written to them.
+ */
+
+#define BOOTLOADER_CAN_CRC      0
+/* If this macro is defined to 1, the host can read a CRC16 of every 128 byte
+ * block in flash. The command line tool uses this to upload only pages which
+ * differ from the flash contents. The CRC report needs 36 bytes of RAM.
+ */
+
+#define BOOTLOADER_CAN_READ     0
+/* If this macro is defined to 1, the host can read back the flash memory in
+ * blocks of 128 bytes. The command line tool needs this for the "--verify"
+ * option. It also enables USB_CFG_IMPLEMENT_FN_READ in the driver.
+ */
+
+#define BOOTLOADER_CAN_SIGNATURE    0
+/* If this macro is defined to 1, the host can read the signature bytes, the
+ * fuses and the lock bits with report 10. The command line tool uses them to
+ * refuse images built for a different MCU and to detect a write protected
+ * application section before it sends any data. The report is built in an
+ * 8 byte RAM buffer.
+ */
+
+#if defined(FLASHEND) && defined(BOOTLOADER_ADDRESS) && (FLASHEND) + 1 - (BOOTLOADER_ADDRESS) > 2048
+#define BOOTLOADER_CAN_LONG_WRITE   1
+#else
+#define BOOTLOADER_CAN_LONG_WRITE   0
+#endif
+/* If this macro is defined to 1, the host can send 512 bytes of flash data
+ * in one report (report 7) instead of 128 bytes. This saves most of the
+ * SETUP, address and status overhead of the transfers. It requires
+ * USB_CFG_LONG_TRANSFERS in usbconfig.h, which is set accordingly. The
+ * driver then counts transfer lengths in 16 bits instead of 8. It is on
+ * by default for boot sections larger than the 2 kB of the ATmega8 example.
+ */
+
+#define BOOTLOADER_ASYNC_WRITE  0
+/* If this macro is defined to 1, received pages are collected in RAM and
+ * erased and written from the main loop while USB requests are served. The
+ * next page is received while the previous one is programmed, and the host
+ * can poll report 8 for the programming status. Pages which are equal to
+ * the flash contents are not erased and written again. If you define it to
+ * 0, pages are programmed in usbFunctionWrite() and USB requests are not
+ * answered until this is done. The two page buffers need 2 * SPM_PAGESIZE
+ * bytes of RAM, 256 bytes on the ATmega8.
+ */
+
+#define BOOTLOADER_CAN_EEPROM   0
+/* If this macro is defined to 1, the host can write EEPROM with report 9 in
+ * blocks of 64 bytes. The bytes are written from the main loop while USB
+ * requests are served, the host polls report 8 until a block is done. Bytes
+ * which are already in EEPROM are not written again. Requires
+ * BOOTLOADER_ASYNC_WRITE. The block buffer needs 64 bytes of RAM.
+ */
+
+#define BOOTLOADER_CHECK_TOGGLE 0
+/* If this macro is defined to 1, data packets which the host sends again
+ * because it did not receive our ACK are recognized by their data toggle
+ * and ignored. Without this check, such a duplicate is written to flash
+ * after the original and shifts the rest of the page. This sets
+ * USB_CFG_CHECK_DATA_TOGGLING in the driver.
+ */
+
+#define BOOTLOADER_CHECK_CRC    0
+/* If this macro is defined to 1, the CRC16 of every received USB packet is
+ * checked. The driver has already acknowledged the packet at this point, so
+ * pages containing corrupted data are not programmed but reported in report
+ * 8 and the host sends them again. Requires BOOTLOADER_ASYNC_WRITE. The
+ * CRC is computed in usbPoll() (USB_RX_USER_HOOK) for every received packet.
+ */
+
+#define BOOTLOADER_APP_CHECK    0
+/* If this macro is defined to 1, the command line tool stores the length and
+ * the CRC16 of the application in the last 8 bytes below BOOTLOADER_ADDRESS.
+ * After reset, the application is started immediately if it matches, without
+ * USB re-enumeration or time out. The boot loader stays active if the
+ * application is damaged or if it is requested with the jumper (or the reset
+ * button if TIMEOUT_ENABLED is set). If the jumper is removed after a valid
+ * application has been uploaded, it is started without a reset. Checking
+ * the CRC delays the start in proportion to the application's length.
+ */
+
+#define BOOTLOADER_SOFT_ENTRY   0
+/* If this macro is defined to 1, a running application can start the boot
+ * loader without an external reset. It stores BOOTLOADER_MAGIC at
+ * BOOTLOADER_MAGIC_ADDRESS and lets the watchdog reset the device:
+ *     cli();
+ *     *(volatile uint16_t *)BOOTLOADER_MAGIC_ADDRESS = BOOTLOADER_MAGIC;
+ *     wdt_enable(WDTO_15MS);
+ *     for(;;);
+ * The boot loader checks the word before RAM is initialized, clears it and
+ * disables the watchdog. It then stays active as if the jumper was set (or
+ * the reset button was pressed). The command line tool can send the request
+ * to the application with the "--from-app" option. The magic word occupies
+ * the first 2 bytes of RAM, the application must not need them across the
+ * reset.
+ */
+#define BOOTLOADER_MAGIC_ADDRESS    RAMSTART    /* first byte of RAM */
+#define BOOTLOADER_MAGIC            0xb007
+
 #define TIMEOUT_ENABLED            1
 /* If TIMEOUT_ENABLED is defined to 1 then the boot loader will always load
  * and stay active until the programmer closes the connection or the time
@@ -141,14 +259,43 @@ these macros are defined, the boot loader usees them.
 #   define TIMEOUT_ENABLED 0
 #endif
 
+#if BOOTLOADER_APP_CHECK
+static unsigned char    appIsValid(void);   /* implemented in main.c */
+#endif
+#if BOOTLOADER_SOFT_ENTRY
+/* Set in main.c before RAM is initialized, so it must not be cleared. */
+static unsigned char    softEntry __attribute__((section(".noinit")));
+#   define bootLoaderSoftEntry()    softEntry
+#else
+#   define bootLoaderSoftEntry()    0
+#endif
+
+#if !TIMEOUT_ENABLED
+#    define bootLoaderCondition()   ((PIND & (1 << JUMPER_BIT)) == 0 || bootLoaderSoftEntry())
+#else
+#    define bootLoaderCondition()    1
+#endif
+
 static inline void  bootLoaderInit(void)
 {
 #if !TIMEOUT_ENABLED
     PORTD |= (1 << JUMPER_BIT);     /* activate pull-up */
     _delay_us(10);  /* wait for levels to stabilize */
 #endif
-    if(!(MCUCSR & (1 << EXTRF)))    /* If this was not an external reset, ignore */
+#if BOOTLOADER_APP_CHECK
+#   if TIMEOUT_ENABLED
+    /* A power-on reset may set EXTRF as well, only the reset button alone
+     * requests the boot loader.
+     */
+    if(appIsValid() && !bootLoaderSoftEntry() && (MCUCSR & ((1 << EXTRF) | (1 << PORF))) != (1 << EXTRF))
+#   else
+    if(appIsValid() && !bootLoaderCondition())
+#   endif
         leaveBootloader();
+#else
+    if(!(MCUCSR & (1 << EXTRF)) && !bootLoaderSoftEntry())  /* If this was not an external reset, ignore */
+        leaveBootloader();
+#endif
     MCUCSR = 0;                     /* clear all reset flags for next time */
 }
 
@@ -164,12 +311,6 @@ static inline void  bootLoaderExit(void)
 DDRC = 0; // turn off LEDs
 }
 
-#if !TIMEOUT_ENABLED
-#    define bootLoaderCondition()   ((PIND & (1 << JUMPER_BIT)) == 0)
-#else
-#    define bootLoaderCondition()    1
-#endif
-
 
 #endif
 
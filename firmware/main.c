@@ -13,12 +13,17 @@
 #include <avr/pgmspace.h>
 #include <avr/wdt.h>
 #include <avr/boot.h>
+#include <avr/eeprom.h>
 #include <string.h>
 #include <util/delay.h>
+#include <util/crc16.h>
 
 static void leaveBootloader() __attribute__((__noreturn__));
 
 #include "bootloaderconfig.h"
+#if BOOTLOADER_CHECK_CRC
+static void usbRxCheckCrc(unsigned char *data, unsigned char len);
+#endif
 #include "usbdrv.c"
 
 /* ------------------------------------------------------------------------ */
@@ -37,20 +42,166 @@ static void leaveBootloader() __attribute__((__noreturn__));
 #   define TIMEOUT_DURATION 10
 #endif
 
+#ifndef BOOTLOADER_EXIT_DELAY
+#   define BOOTLOADER_EXIT_DELAY    2
+#endif
+#ifndef BOOTLOADER_CAN_ERASE
+#   define BOOTLOADER_CAN_ERASE 0
+#endif
+#ifndef BOOTLOADER_CAN_CRC
+#   define BOOTLOADER_CAN_CRC   0
+#endif
+#ifndef BOOTLOADER_CAN_READ
+#   define BOOTLOADER_CAN_READ  0
+#endif
+#ifndef BOOTLOADER_CAN_SIGNATURE
+#   define BOOTLOADER_CAN_SIGNATURE 0
+#endif
+#ifndef BOOTLOADER_CAN_LONG_WRITE
+#   define BOOTLOADER_CAN_LONG_WRITE    0
+#endif
+#ifndef BOOTLOADER_ASYNC_WRITE
+#   define BOOTLOADER_ASYNC_WRITE   0
+#endif
+#ifndef BOOTLOADER_CHECK_CRC
+#   define BOOTLOADER_CHECK_CRC     0
+#endif
+#ifndef BOOTLOADER_CHECK_TOGGLE
+#   define BOOTLOADER_CHECK_TOGGLE  0
+#endif
+#ifndef BOOTLOADER_APP_CHECK
+#   define BOOTLOADER_APP_CHECK     0
+#endif
+#ifndef BOOTLOADER_SOFT_ENTRY
+#   define BOOTLOADER_SOFT_ENTRY    0
+#endif
+#ifndef BOOTLOADER_CAN_EEPROM
+#   define BOOTLOADER_CAN_EEPROM    0
+#endif
+#if BOOTLOADER_CAN_EEPROM && !BOOTLOADER_ASYNC_WRITE
+#   error "BOOTLOADER_CAN_EEPROM requires BOOTLOADER_ASYNC_WRITE"
+#endif
+#if BOOTLOADER_CHECK_CRC && !BOOTLOADER_ASYNC_WRITE
+#   error "BOOTLOADER_CHECK_CRC requires BOOTLOADER_ASYNC_WRITE"
+#endif
+#define HAVE_READ_ADDRESS   (BOOTLOADER_CAN_CRC || BOOTLOADER_CAN_READ)
+
+/* Bits in the feature byte of the device info report: */
+#define FEATURE_ERASE       0x01    /* report 3 erases the application section */
+#define FEATURE_CRC         0x02    /* reports 4 and 5 return block CRCs */
+#define FEATURE_READ        0x04    /* reports 4 and 6 read back flash */
+#define FEATURE_STATUS      0x08    /* report 8 returns the programming status */
+#define FEATURE_CHECK       0x10    /* corrupted pages are reported in report 8 */
+#define FEATURE_APP_CHECK   0x20    /* application is checked against its trailer */
+#define FEATURE_EEPROM      0x40    /* report 9 writes EEPROM */
+#define FEATURE_SIGNATURE   0x80    /* report 10 returns signature, fuses and lock bits */
+
+/* Bits in the flags byte of the status report: */
+#define STATUS_BUSY         0x01    /* pages are waiting to be programmed */
+#define STATUS_FAILED       0x02    /* received data was corrupted */
+#define STATUS_EEPROM_BUSY  0x04    /* EEPROM bytes are waiting to be written */
+#define STATUS_EEPROM_FAILED    0x08    /* EEPROM data was corrupted and dropped */
+
+/* Version of the report layout, incremented when reports are added or changed.
+ * Boot loaders which don't send this field have version 0.
+ */
+#define PROTOCOL_VERSION    6
+#define BLOCK_SIZE          128     /* data bytes in report 2 */
+#define LONG_BLOCK_SIZE     512     /* data bytes in report 7 */
+#define EEPROM_BLOCK_SIZE   64      /* data bytes in report 9 */
+#if BOOTLOADER_CAN_LONG_WRITE
+#   define MAX_BLOCK_SIZE   LONG_BLOCK_SIZE
+#   define offset_t         uint
+#else
+#   define MAX_BLOCK_SIZE   BLOCK_SIZE
+#   define offset_t         uchar
+#endif
+
+#define EXIT_STATUS_TIMEOUT 100     /* ms to wait for the status stage of the exit request */
+
+#define CRC_BLOCK_SIZE      128     /* bytes covered by one CRC in report 5 */
+#define CRC_BLOCKS          16      /* number of CRCs in report 5 */
+
+/* The application trailer holds the length of the application (4 bytes), the
+ * CRC16 of this many bytes from address 0 (2 bytes) and APP_TRAILER_MAGIC.
+ */
+#define APP_TRAILER_ADDRESS ((addr_t)BOOTLOADER_ADDRESS - 8)
+#define APP_TRAILER_MAGIC   0x4842
+
 #if (FLASHEND) > 0xffff /* we need long addressing */
 #   define addr_t           ulong
+#   define readFlashByte(addr)  pgm_read_byte_far(addr)
 #else
 #   define addr_t           uint
+#   define readFlashByte(addr)  pgm_read_byte(addr)
 #endif
 
 static addr_t           currentAddress; /* in bytes */
-static uchar            offset;         /* data already processed in current transfer */
+static offset_t         offset;         /* data already processed in current transfer */
+static offset_t         blockSize;      /* data bytes expected in current transfer */
+#if USB_CFG_CHECK_DATA_TOGGLING
+static uchar            expectedDataToken;  /* PID of the next new data packet */
+#endif
 #if BOOTLOADER_CAN_EXIT
-static uchar            exitMainloop;
+static uchar            exitMainloop;   /* ms left to wait for the status stage */
+#endif
+#if HAVE_READ_ADDRESS
+static addr_t           readAddress;    /* set with report 4 */
+#endif
+#if BOOTLOADER_CAN_CRC
+static uchar            crcReport[4 + 2 * CRC_BLOCKS];
+#endif
+#if BOOTLOADER_CAN_SIGNATURE
+static uchar            signatureReport[8];
+#endif
+#if BOOTLOADER_ASYNC_WRITE
+#define PAGE_FREE       0   /* buffer can receive data */
+#define PAGE_FULL       1   /* buffer waits to be programmed */
+#define COMMIT_IDLE     0
+#define COMMIT_ERASE    1   /* page erase in progress */
+#define COMMIT_WRITE    2   /* page write in progress */
+static uchar            pageBuffer[2][SPM_PAGESIZE];
+static addr_t           pageAddress[2];
+static uchar            pageState[2];
+static uchar            fillIndex;      /* buffer which receives data */
+static uchar            commitIndex;    /* buffer which is programmed next */
+static uchar            commitState;
+static addr_t           commitAddress;  /* page being erased or written */
+static addr_t           committedAddress;   /* end of the last page written */
+static uint             pagesWritten;
+static uint             pagesSkipped;   /* received pages equal to flash */
+#if BOOTLOADER_CAN_ERASE
+static uchar            erasing;        /* erase of the application section running */
+static addr_t           eraseAddress;   /* next page to erase */
+#endif
+static uchar            statusReport[16];
+#endif
+#if BOOTLOADER_CAN_EEPROM
+static uchar            writingEeprom;  /* current transfer is report 9 */
+static uchar            eepromBuffer[EEPROM_BLOCK_SIZE];
+static uchar            eepromLength;   /* bytes to write, 0 if buffer is free */
+static uchar            eepromIndex;    /* next byte in eepromBuffer */
+static uint             eepromAddress;  /* EEPROM address of the next byte */
+static uint             eepromWritten;  /* bytes which differed and were written */
+#if BOOTLOADER_CHECK_CRC
+static uchar            eepromFailed;   /* a block was dropped because of corruption */
+#endif
+#endif
+#if BOOTLOADER_APP_CHECK
+static uchar            appValid;       /* result of the last appIsValid() */
+static uchar            appChanged;     /* flash was programmed since then */
+#endif
+#if BOOTLOADER_CHECK_CRC
+static uchar            rxCrcError;     /* CRC of the last packet was wrong */
+static uchar            reportFailed;   /* header of current report was corrupted */
+static uchar            pageFailed[2];  /* page buffer contains corrupted data */
+static uchar            haveFailure;    /* failedAddress is valid */
+static addr_t           failedAddress;  /* data from here on must be sent again */
+static uint             pagesFailed;    /* pages dropped because of corruption */
 #endif
 
 
-PROGMEM char usbHidReportDescriptor[33] = {
+PROGMEM char usbHidReportDescriptor[] = {
     0x06, 0x00, 0xff,              // USAGE_PAGE (Generic Desktop)
     0x09, 0x01,                    // USAGE (Vendor Usage 1)
     0xa1, 0x01,                    // COLLECTION (Application)
@@ -59,7 +210,7 @@ PROGMEM char usbHidReportDescriptor[33] = {
     0x75, 0x08,                    //   REPORT_SIZE (8)
 
     0x85, 0x01,                    //   REPORT_ID (1)
-    0x95, 0x06,                    //   REPORT_COUNT (6)
+    0x95, 0x14,                    //   REPORT_COUNT (20)
     0x09, 0x00,                    //   USAGE (Undefined)
     0xb2, 0x02, 0x01,              //   FEATURE (Data,Var,Abs,Buf)
 
@@ -67,9 +218,68 @@ PROGMEM char usbHidReportDescriptor[33] = {
     0x95, 0x83,                    //   REPORT_COUNT (131)
     0x09, 0x00,                    //   USAGE (Undefined)
     0xb2, 0x02, 0x01,              //   FEATURE (Data,Var,Abs,Buf)
+
+#if BOOTLOADER_CAN_ERASE
+    0x85, 0x03,                    //   REPORT_ID (3)
+    0x95, 0x01,                    //   REPORT_COUNT (1)
+    0x09, 0x00,                    //   USAGE (Undefined)
+    0xb2, 0x02, 0x01,              //   FEATURE (Data,Var,Abs,Buf)
+#endif
+
+#if HAVE_READ_ADDRESS
+    0x85, 0x04,                    //   REPORT_ID (4)
+    0x95, 0x03,                    //   REPORT_COUNT (3)
+    0x09, 0x00,                    //   USAGE (Undefined)
+    0xb2, 0x02, 0x01,              //   FEATURE (Data,Var,Abs,Buf)
+#endif
+
+#if BOOTLOADER_CAN_CRC
+    0x85, 0x05,                    //   REPORT_ID (5)
+    0x95, 0x23,                    //   REPORT_COUNT (35)
+    0x09, 0x00,                    //   USAGE (Undefined)
+    0xb2, 0x02, 0x01,              //   FEATURE (Data,Var,Abs,Buf)
+#endif
+
+#if BOOTLOADER_CAN_READ
+    0x85, 0x06,                    //   REPORT_ID (6)
+    0x95, 0x83,                    //   REPORT_COUNT (131)
+    0x09, 0x00,                    //   USAGE (Undefined)
+    0xb2, 0x02, 0x01,              //   FEATURE (Data,Var,Abs,Buf)
+#endif
+
+#if BOOTLOADER_CAN_LONG_WRITE
+    0x85, 0x07,                    //   REPORT_ID (7)
+    0x96, 0x03, 0x02,              //   REPORT_COUNT (515)
+    0x09, 0x00,                    //   USAGE (Undefined)
+    0xb2, 0x02, 0x01,              //   FEATURE (Data,Var,Abs,Buf)
+#endif
+
+#if BOOTLOADER_ASYNC_WRITE
+    0x85, 0x08,                    //   REPORT_ID (8)
+    0x95, 0x0f,                    //   REPORT_COUNT (15)
+    0x09, 0x00,                    //   USAGE (Undefined)
+    0xb2, 0x02, 0x01,              //   FEATURE (Data,Var,Abs,Buf)
+#endif
+
+#if BOOTLOADER_CAN_EEPROM
+    0x85, 0x09,                    //   REPORT_ID (9)
+    0x95, 0x44,                    //   REPORT_COUNT (68)
+    0x09, 0x00,                    //   USAGE (Undefined)
+    0xb2, 0x02, 0x01,              //   FEATURE (Data,Var,Abs,Buf)
+#endif
+
+#if BOOTLOADER_CAN_SIGNATURE
+    0x85, 0x0a,                    //   REPORT_ID (10)
+    0x95, 0x07,                    //   REPORT_COUNT (7)
+    0x09, 0x00,                    //   USAGE (Undefined)
+    0xb2, 0x02, 0x01,              //   FEATURE (Data,Var,Abs,Buf)
+#endif
     0xc0                           // END_COLLECTION
 };
 
+/* fails to compile if USB_CFG_HID_REPORT_DESCRIPTOR_LENGTH is out of sync: */
+typedef char descriptorLengthCheck[sizeof(usbHidReportDescriptor) == USB_CFG_HID_REPORT_DESCRIPTOR_LENGTH ? 1 : -1];
+
 /* allow compatibility with avrusbboot's bootloaderconfig.h: */
 #ifdef BOOTLOADER_INIT
 #   define bootLoaderInit()         BOOTLOADER_INIT
@@ -103,11 +313,23 @@ static uint8_t          inactivity_timer_nsec;
 static void inactivity_timer_start(void);
 static void inactivity_timer_stop(void);
 #endif
+#if BOOTLOADER_ASYNC_WRITE
+static void commitFlush(void);
+#endif
+#if BOOTLOADER_CAN_EEPROM
+static void eepromFlush(void);
+#endif
 static void (*nullVector)(void) __attribute__((__noreturn__));
 
 static void leaveBootloader()
 {
     DBG1(0x01, 0, 0);
+#if BOOTLOADER_ASYNC_WRITE
+    commitFlush();
+#endif
+#if BOOTLOADER_CAN_EEPROM
+    eepromFlush();
+#endif
     cli();
     boot_rww_enable();
     USB_INTR_ENABLE = 0;
@@ -125,35 +347,535 @@ static void leaveBootloader()
     nullVector();
 }
 
-uchar   usbFunctionSetup(uchar data[8])
+#if BOOTLOADER_SOFT_ENTRY
+/* Runs from the startup code before RAM is initialized, so the word which the
+ * application stored at BOOTLOADER_MAGIC_ADDRESS is still there. It is only
+ * accepted after a watchdog reset and cleared, so that the next reset starts
+ * the application again. The watchdog stays enabled after a watchdog reset
+ * on newer devices, we turn it off since we don't serve it everywhere.
+ */
+static void __attribute__((naked, used, section(".init3")))  checkSoftEntry(void)
+{
+volatile uint   *magic = (volatile uint *)BOOTLOADER_MAGIC_ADDRESS;
+
+    softEntry = 0;
+    if((MCUCSR & (1 << WDRF)) && *magic == BOOTLOADER_MAGIC){
+        softEntry = 1;
+        MCUCSR &= ~(1 << WDRF);
+        wdt_disable();
+    }
+    *magic = 0;
+}
+#endif
+
+#if BOOTLOADER_ASYNC_WRITE
+/* Returns non-zero if the page in buffer 'index' equals the flash contents.
+ * The RWW section must be readable.
+ */
+static uchar    pageUnchanged(uchar index)
+{
+uchar   *p = pageBuffer[index];
+addr_t  address = pageAddress[index];
+uint    i;
+
+    for(i = 0; i < SPM_PAGESIZE; i++){
+        if(p[i] != readFlashByte(address + i))
+            return 0;
+    }
+    return 1;
+}
+
+/* Advances the programming of received pages by one step. A page is erased,
+ * copied from RAM to the page buffer and written. Erase and write run in the
+ * RWW section while we continue to serve USB requests, so this function
+ * returns immediately if the previous step has not completed yet. Pages which
+ * are already in flash are not programmed again.
+ */
+static void commitStep(void)
+{
+uchar   *p;
+uint    i;
+
+    if(boot_spm_busy())
+        return;
+#if BOOTLOADER_CAN_EEPROM
+    if(!eeprom_is_ready())  /* SPM must not run while EEPROM is written */
+        return;
+#endif
+#if BOOTLOADER_CAN_ERASE
+    if(erasing){    /* received pages wait until the erase is complete */
+        if(eraseAddress >= (addr_t)BOOTLOADER_ADDRESS){
+            erasing = 0;    /* last page is erased */
+            return;
+        }
+#ifndef TEST_MODE
+        cli();
+        boot_page_erase(eraseAddress);
+        sei();
+#endif
+        eraseAddress += SPM_PAGESIZE;
+        return;
+    }
+#endif
+    switch(commitState){
+    case COMMIT_WRITE:      /* previous page is done */
+        committedAddress = commitAddress + SPM_PAGESIZE;
+        pagesWritten++;
+#if BOOTLOADER_APP_CHECK
+        appChanged = 1;
+#endif
+        commitState = COMMIT_IDLE;
+        /* fall through */
+    case COMMIT_IDLE:
+        if(pageState[commitIndex] != PAGE_FULL)
+            break;
+        commitAddress = pageAddress[commitIndex];
+#ifndef TEST_MODE
+        boot_rww_enable();  /* make flash readable after the last write */
+#endif
+        if(pageUnchanged(commitIndex)){
+            committedAddress = commitAddress + SPM_PAGESIZE;
+            pagesSkipped++;
+            pageState[commitIndex] = PAGE_FREE;
+            commitIndex ^= 1;
+            break;
+        }
+        DBG1(0x33, 0, 0);
+#ifndef TEST_MODE
+        cli();
+        boot_page_erase(commitAddress);
+        sei();
+#endif
+        commitState = COMMIT_ERASE;
+        break;
+    case COMMIT_ERASE:      /* page is erased, fill page buffer and write */
+        p = pageBuffer[commitIndex];
+        for(i = 0; i < SPM_PAGESIZE; i += 2){
+            cli();
+            boot_page_fill(commitAddress + i, *(short *)(p + i));
+            sei();
+        }
+        pageState[commitIndex] = PAGE_FREE;
+        commitIndex ^= 1;
+        DBG1(0x34, 0, 0);
+#ifndef TEST_MODE
+        cli();
+        boot_page_write(commitAddress);
+        sei();
+#endif
+        commitState = COMMIT_WRITE;
+        break;
+    }
+}
+
+/* Returns non-zero while pages are waiting to be programmed or the
+ * application section is being erased.
+ */
+static uchar    commitIsBusy(void)
+{
+#if BOOTLOADER_CAN_ERASE
+    if(erasing)
+        return 1;
+#endif
+    return commitState != COMMIT_IDLE || pageState[commitIndex] == PAGE_FULL;
+}
+
+/* Programs all pending pages and makes the flash readable again. Called
+ * before anything which reads or erases flash.
+ */
+static void commitFlush(void)
+{
+    while(commitIsBusy()){
+        wdt_reset();
+        commitStep();
+    }
+#ifndef TEST_MODE
+    boot_rww_enable();
+#endif
+}
+
+static void buildStatusReport(void)
+{
+uchar   *p = statusReport;
+
+    *p++ = 8;   /* report ID */
+    *p = commitIsBusy() ? STATUS_BUSY : 0;
+#if BOOTLOADER_CHECK_CRC
+    if(haveFailure)
+        *p |= STATUS_FAILED;
+#endif
+#if BOOTLOADER_CAN_EEPROM
+    if(eepromLength != 0 || !eeprom_is_ready())
+        *p |= STATUS_EEPROM_BUSY;
+#if BOOTLOADER_CHECK_CRC
+    if(eepromFailed)
+        *p |= STATUS_EEPROM_FAILED;
+#endif
+#endif
+    p++;
+    *p++ = committedAddress;
+    *p++ = committedAddress >> 8;
+#if (FLASHEND) > 0xffff
+    *p++ = committedAddress >> 16;
+#else
+    *p++ = 0;
+#endif
+    *p++ = pagesWritten;
+    *p++ = pagesWritten >> 8;
+    *p++ = pagesSkipped;
+    *p++ = pagesSkipped >> 8;
+#if BOOTLOADER_CHECK_CRC
+    *p++ = failedAddress;
+    *p++ = failedAddress >> 8;
+#if (FLASHEND) > 0xffff
+    *p++ = failedAddress >> 16;
+#else
+    *p++ = 0;
+#endif
+    *p++ = pagesFailed;
+    *p++ = pagesFailed >> 8;
+#else
+    p += 5;
+#endif
+#if BOOTLOADER_CAN_EEPROM
+    *p++ = eepromWritten;
+    *p++ = eepromWritten >> 8;
+#endif
+}
+#endif
+
+#if BOOTLOADER_CAN_EEPROM
+/* Writes the next byte from eepromBuffer if the EEPROM is ready. Bytes which
+ * are already in EEPROM are skipped. A byte takes several ms, we don't wait.
+ */
+static void eepromStep(void)
+{
+    if(eepromLength == 0 || !eeprom_is_ready() || boot_spm_busy())
+        return;
+    if(eeprom_read_byte((uint8_t *)eepromAddress) != eepromBuffer[eepromIndex]){
+        eeprom_write_byte((uint8_t *)eepromAddress, eepromBuffer[eepromIndex]);
+        eepromWritten++;
+    }
+    eepromAddress++;
+    if(++eepromIndex >= eepromLength){
+        eepromIndex = 0;
+        eepromLength = 0;   /* buffer can receive the next block */
+    }
+}
+
+/* Writes all pending bytes and waits for the last write to complete. */
+static void eepromFlush(void)
+{
+    while(eepromLength != 0){
+        wdt_reset();
+        eepromStep();
+    }
+    eeprom_busy_wait();
+}
+
+/* Receives report 9: 3 address bytes, the number of valid data bytes and
+ * EEPROM_BLOCK_SIZE data bytes. The host waits until the previous block is
+ * written before it sends the next one.
+ */
+static uchar    eepromReceive(uchar *data, uchar len)
+{
+uchar   isLast;
+
+    if(offset == 0){
+        eepromFlush();  /* only if the host did not wait */
+        eepromAddress = data[1] | (data[2] << 8);
+        eepromIndex = data[4];  /* length, until the block is complete */
+        data += 5;
+        len -= 5;
+    }
+    for(; len > 0 && offset < EEPROM_BLOCK_SIZE; len--)
+        eepromBuffer[offset++] = *data++;
+    isLast = offset >= EEPROM_BLOCK_SIZE;
+#if BOOTLOADER_CHECK_CRC
+    reportFailed |= rxCrcError;
+#endif
+    if(isLast){
+        eepromLength = eepromIndex > EEPROM_BLOCK_SIZE ? EEPROM_BLOCK_SIZE : eepromIndex;
+        eepromIndex = 0;
+#if BOOTLOADER_CHECK_CRC
+        if(reportFailed){   /* drop it, the host sends it again */
+            eepromLength = 0;
+            eepromFailed = 1;
+        }
+#endif
+    }
+    return isLast;
+}
+#endif
+
+#if BOOTLOADER_CHECK_CRC
+/* Called by the driver for every received packet. The two CRC bytes follow
+ * the data in the receive buffer.
+ */
+static void usbRxCheckCrc(uchar *data, uchar len)
+{
+    rxCrcError = usbCrc16(data, len) != (data[len] | (data[len + 1] << 8));
+}
+
+/* Records that the data from 'address' on must be sent again. The host sends
+ * in ascending order, so the first failure has the lowest address.
+ */
+static void noteFailure(addr_t address)
+{
+    if(!haveFailure){
+        haveFailure = 1;
+        failedAddress = address;
+    }
+}
+#endif
+
+#if BOOTLOADER_APP_CHECK
+static uint readFlashWord(addr_t address)
+{
+    return readFlashByte(address) | (readFlashByte(address + 1) << 8);
+}
+
+/* Returns non-zero if the application matches the trailer. Erased flash
+ * fails the check of the magic number.
+ */
+static uchar    appIsValid(void)
+{
+addr_t  address;
+ulong   length;
+uint    crc = 0xffff;
+
+    appValid = 0;
+    if(readFlashWord(APP_TRAILER_ADDRESS + 6) != APP_TRAILER_MAGIC)
+        return 0;
+    length = readFlashWord(APP_TRAILER_ADDRESS) | ((ulong)readFlashWord(APP_TRAILER_ADDRESS + 2) << 16);
+    if(length > APP_TRAILER_ADDRESS)
+        return 0;
+    for(address = 0; address < length; address++){
+        wdt_reset();
+        crc = _crc16_update(crc, readFlashByte(address));
+    }
+    appValid = (uint)~crc == readFlashWord(APP_TRAILER_ADDRESS + 4);
+    return appValid;
+}
+#endif
+
+#if BOOTLOADER_CAN_ERASE
+/* Erases all pages below the boot loader. This takes up to several seconds
+ * on devices with much flash. With BOOTLOADER_ASYNC_WRITE, we only start the
+ * erase here and commitStep() erases page by page from the main loop. The
+ * host polls the status report until we are no longer busy. Otherwise the
+ * host waits for the status stage of the request until we are done.
+ */
+static void eraseApplication(void)
+{
+#if !BOOTLOADER_ASYNC_WRITE
+addr_t  address = 0;
+#endif
+
+#if BOOTLOADER_ASYNC_WRITE
+    commitFlush();
+#endif
+#if BOOTLOADER_CAN_EEPROM
+    eepromFlush();
+#endif
+#if BOOTLOADER_APP_CHECK
+    appChanged = 1;
+#endif
+#if BOOTLOADER_ASYNC_WRITE
+    eraseAddress = 0;
+    erasing = 1;
+#else
+    do{
+        wdt_reset();
+#ifndef TEST_MODE
+        cli();
+        boot_page_erase(address);
+        sei();
+        boot_spm_busy_wait();
+#endif
+        address += SPM_PAGESIZE;
+    }while(address < (addr_t)BOOTLOADER_ADDRESS);
+#ifndef TEST_MODE
+    boot_rww_enable();
+#endif
+#endif
+}
+#endif
+
+#if BOOTLOADER_CAN_CRC
+/* Fills crcReport with the CRCs of CRC_BLOCKS blocks starting at readAddress
+ * and advances readAddress. The CRC is the same as computed by usbCrc16(),
+ * but we read directly from flash instead of copying each block to RAM.
+ */
+static void buildCrcReport(void)
+{
+uchar   *p = crcReport;
+uchar   i, j;
+uint    crc;
+
+    *p++ = 5;   /* report ID */
+    *p++ = readAddress;
+    *p++ = readAddress >> 8;
+#if (FLASHEND) > 0xffff
+    *p++ = readAddress >> 16;
+#else
+    *p++ = 0;
+#endif
+    for(i = 0; i < CRC_BLOCKS; i++){
+        crc = 0xffff;
+        j = CRC_BLOCK_SIZE;
+        do{
+            crc = _crc16_update(crc, readFlashByte(readAddress));
+            readAddress++;
+        }while(--j);
+        crc = ~crc;
+        *p++ = crc;
+        *p++ = crc >> 8;
+        wdt_reset();
+    }
+}
+#endif
+
+#if BOOTLOADER_CAN_SIGNATURE
+/* Fills signatureReport with the 3 signature bytes, the low, high and
+ * extended fuse and the lock bits. Devices without SIGRD report the
+ * signature we were compiled for. The reads use SPM, which must be idle.
+ */
+static void buildSignatureReport(void)
+{
+uchar   *p = signatureReport;
+
+    boot_spm_busy_wait();
+    eeprom_busy_wait();
+    *p++ = 10;  /* report ID */
+#ifdef SIGRD
+    *p++ = boot_signature_byte_get(0);
+    *p++ = boot_signature_byte_get(2);
+    *p++ = boot_signature_byte_get(4);
+#else
+    *p++ = SIGNATURE_0;
+    *p++ = SIGNATURE_1;
+    *p++ = SIGNATURE_2;
+#endif
+    *p++ = boot_lock_fuse_bits_get(GET_LOW_FUSE_BITS);
+    *p++ = boot_lock_fuse_bits_get(GET_HIGH_FUSE_BITS);
+    *p++ = boot_lock_fuse_bits_get(GET_EXTENDED_FUSE_BITS);
+    *p = boot_lock_fuse_bits_get(GET_LOCK_BITS);
+}
+#endif
+
+usbMsgLen_t usbFunctionSetup(uchar data[8])
 {
 usbRequest_t    *rq = (void *)data;
 #if TIMEOUT_ENABLED
     inactivity_timer_stop();
 #endif
-static uchar    replyBuffer[7] = {
+static uchar    replyBuffer[21] = {
         1,                              /* report ID */
         SPM_PAGESIZE & 0xff,
         SPM_PAGESIZE >> 8,
         ((long)FLASHEND + 1) & 0xff,
         (((long)FLASHEND + 1) >> 8) & 0xff,
         (((long)FLASHEND + 1) >> 16) & 0xff,
-        (((long)FLASHEND + 1) >> 24) & 0xff
+        (((long)FLASHEND + 1) >> 24) & 0xff,
+        (BOOTLOADER_CAN_ERASE ? FEATURE_ERASE : 0) | (BOOTLOADER_CAN_CRC ? FEATURE_CRC : 0) |
+        (BOOTLOADER_CAN_READ ? FEATURE_READ : 0) | (BOOTLOADER_ASYNC_WRITE ? FEATURE_STATUS : 0) |
+        (BOOTLOADER_CHECK_CRC ? FEATURE_CHECK : 0) | (BOOTLOADER_APP_CHECK ? FEATURE_APP_CHECK : 0) |
+        (BOOTLOADER_CAN_EEPROM ? FEATURE_EEPROM : 0) | (BOOTLOADER_CAN_SIGNATURE ? FEATURE_SIGNATURE : 0),
+        PROTOCOL_VERSION,
+        (long)BOOTLOADER_ADDRESS & 0xff,   /* start of boot loader section */
+        ((long)BOOTLOADER_ADDRESS >> 8) & 0xff,
+        ((long)BOOTLOADER_ADDRESS >> 16) & 0xff,
+        ((long)BOOTLOADER_ADDRESS >> 24) & 0xff,
+        MAX_BLOCK_SIZE & 0xff,
+        MAX_BLOCK_SIZE >> 8,
+        USBDRV_VERSION & 0xff,
+        (USBDRV_VERSION >> 8) & 0xff,
+        (USBDRV_VERSION >> 16) & 0xff,
+        ((long)USBDRV_VERSION >> 24) & 0xff,
+        ((long)E2END + 1) & 0xff,           /* EEPROM size */
+        ((long)E2END + 1) >> 8
     };
 
     if(rq->bRequest == USBRQ_HID_SET_REPORT){
-        if(rq->wValue.bytes[0] == 2){
+#if USB_CFG_CHECK_DATA_TOGGLING
+        expectedDataToken = USBPID_DATA1;   /* data stage starts with DATA1 */
+#endif
+#if BOOTLOADER_CAN_EEPROM
+        writingEeprom = 0;
+#endif
+        if(rq->wValue.bytes[0] == 2 || (HAVE_READ_ADDRESS && rq->wValue.bytes[0] == 4)){
+            offset = 0;
+            blockSize = BLOCK_SIZE;
+            return USB_NO_MSG;
+        }
+#if BOOTLOADER_CAN_LONG_WRITE
+        else if(rq->wValue.bytes[0] == 7){
             offset = 0;
+            blockSize = LONG_BLOCK_SIZE;
             return USB_NO_MSG;
         }
+#endif
+#if BOOTLOADER_CAN_EEPROM
+        else if(rq->wValue.bytes[0] == 9){
+            offset = 0;
+            writingEeprom = 1;
+#if BOOTLOADER_CHECK_CRC
+            reportFailed = 0;
+#endif
+            return USB_NO_MSG;
+        }
+#endif
+#if BOOTLOADER_CAN_ERASE
+        else if(rq->wValue.bytes[0] == 3){
+            eraseApplication();
+        }
+#endif
 #if BOOTLOADER_CAN_EXIT
-        else{
-            exitMainloop = 1;
+        else if(rq->wValue.bytes[0] == 1){
+            exitMainloop = EXIT_STATUS_TIMEOUT;
+        }
+#endif
+#if BOOTLOADER_CHECK_CRC
+        else if(rq->wValue.bytes[0] == 8){
+            haveFailure = 0;    /* host has seen the failure */
+#if BOOTLOADER_CAN_EEPROM
+            eepromFailed = 0;
+#endif
         }
 #endif
     }else if(rq->bRequest == USBRQ_HID_GET_REPORT){
+#if BOOTLOADER_ASYNC_WRITE
+        if(rq->wValue.bytes[0] == 8){
+            buildStatusReport();
+            usbMsgPtr = statusReport;
+            return sizeof(statusReport);
+        }
+        if(rq->wValue.bytes[0] == 5 || rq->wValue.bytes[0] == 6)
+            commitFlush();  /* flash must be programmed and readable */
+#endif
+#if BOOTLOADER_CAN_SIGNATURE
+        if(rq->wValue.bytes[0] == 10){
+            buildSignatureReport();
+            usbMsgPtr = signatureReport;
+            return sizeof(signatureReport);
+        }
+#endif
+#if BOOTLOADER_CAN_CRC
+        if(rq->wValue.bytes[0] == 5){
+            buildCrcReport();
+            usbMsgPtr = crcReport;
+            return sizeof(crcReport);
+        }
+#endif
+#if BOOTLOADER_CAN_READ
+        if(rq->wValue.bytes[0] == 6){
+            offset = 0;
+            return USB_NO_MSG;  /* data is sent by usbFunctionRead() */
+        }
+#endif
         usbMsgPtr = replyBuffer;
-        return 7;
+        return sizeof(replyBuffer);
     }
 #if TIMEOUT_ENABLED
     inactivity_timer_start();
@@ -171,8 +893,22 @@ union {
 }       address;
 uchar   isLast;
 
+#if USB_CFG_CHECK_DATA_TOGGLING
+    if(usbCurrentDataToken != expectedDataToken)
+        return 0;   /* the host repeated a packet we have already processed */
+    expectedDataToken ^= USBPID_DATA0 ^ USBPID_DATA1;
+#endif
 #if TIMEOUT_ENABLED
     inactivity_timer_stop();
+#endif
+#if BOOTLOADER_CAN_EEPROM
+    if(writingEeprom){
+        isLast = eepromReceive(data, len);
+#if TIMEOUT_ENABLED
+        inactivity_timer_start();
+#endif
+        return isLast;
+    }
 #endif
     address.l = currentAddress;
     if(offset == 0){
@@ -182,13 +918,27 @@ uchar   isLast;
 #if (FLASHEND) > 0xffff /* we need long addressing */
         address.c[2] = data[3];
         address.c[3] = 0;
+#endif
+#if HAVE_READ_ADDRESS
+        if(data[0] == 4){   /* report 4 only sets the read address */
+            readAddress = address.l;
+#if TIMEOUT_ENABLED
+            inactivity_timer_start();
+#endif
+            return 1;
+        }
+#endif
+#if BOOTLOADER_CHECK_CRC
+        /* if the address is corrupted, we don't know where the data belongs */
+        if((reportFailed = rxCrcError) != 0)
+            noteFailure(currentAddress);
 #endif
         data += 4;
         len -= 4;
     }
     DBG1(0x31, (void *)&currentAddress, 4);
     offset += len;
-    isLast = offset & 0x80; /* != 0 if last block received */
+    isLast = offset >= blockSize;
     do{
         addr_t prevAddr;
 #if SPM_PAGESIZE > 256
@@ -198,6 +948,35 @@ uchar   isLast;
 #endif
         DBG1(0x32, 0, 0);
         pageAddr = address.s[0] & (SPM_PAGESIZE - 1);
+#if BOOTLOADER_ASYNC_WRITE
+        /* Both buffers are only busy if the host sends faster than we can
+         * program. We wait here and the driver NAKs further data meanwhile.
+         */
+        while(pageState[fillIndex] != PAGE_FREE){
+            wdt_reset();
+            commitStep();
+        }
+        *(short *)&pageBuffer[fillIndex][pageAddr] = *(short *)data;
+#if BOOTLOADER_CHECK_CRC
+        pageFailed[fillIndex] |= rxCrcError | reportFailed;
+#endif
+        prevAddr = address.l;
+        address.l += 2;
+        data += 2;
+        if((address.s[0] & (SPM_PAGESIZE - 1)) == 0){  /* page complete */
+            pageAddress[fillIndex] = prevAddr & ~(addr_t)(SPM_PAGESIZE - 1);
+            pageState[fillIndex] = PAGE_FULL;
+#if BOOTLOADER_CHECK_CRC
+            if(pageFailed[fillIndex]){  /* drop it, the host sends it again */
+                pageFailed[fillIndex] = 0;
+                pageState[fillIndex] = PAGE_FREE;
+                pagesFailed++;
+                noteFailure(pageAddress[fillIndex]);
+            }
+#endif
+            fillIndex ^= 1;
+        }
+#else
         if(pageAddr == 0){              /* if page start: erase */
             DBG1(0x33, 0, 0);
 #ifndef TEST_MODE
@@ -222,9 +1001,13 @@ uchar   isLast;
             boot_page_write(prevAddr);
             sei();
             boot_spm_busy_wait();
+            boot_rww_enable();  /* reports 5 and 6 read the page back */
+#endif
+#if BOOTLOADER_APP_CHECK
+            appChanged = 1;
 #endif
-
         }
+#endif
         len -= 2;
     }while(len);
     currentAddress = address.l;
@@ -237,6 +1020,34 @@ uchar   isLast;
     return isLast;
 }
 
+#if BOOTLOADER_CAN_READ
+/* Sends report 6: report ID, 3 address bytes and 128 bytes of flash data
+ * starting at readAddress. readAddress is advanced so that consecutive
+ * reports return consecutive blocks.
+ */
+uchar usbFunctionRead(uchar *data, uchar len)
+{
+uchar   i = 0;
+
+    if(offset == 0){    /* first packet starts with report ID and address */
+        data[0] = 6;
+        data[1] = readAddress;
+        data[2] = readAddress >> 8;
+#if (FLASHEND) > 0xffff
+        data[3] = readAddress >> 16;
+#else
+        data[3] = 0;
+#endif
+        i = offset = 4;
+    }
+    for(; i < len && offset < 4 + BLOCK_SIZE; i++, offset++){
+        data[i] = readFlashByte(readAddress);
+        readAddress++;
+    }
+    return i;
+}
+#endif
+
 #if TIMEOUT_ENABLED
 static void inactivity_timer_start(void)
 {
@@ -288,8 +1099,11 @@ int __attribute__((noreturn)) main(void)
     odDebugInit();
     DBG1(0x00, 0, 0);
     /* jump to application if jumper is set */
+#if BOOTLOADER_APP_CHECK
+    if(bootLoaderCondition() || !appValid){
+#else
     if(bootLoaderCondition()){
-        uchar i = 0, j = 0;
+#endif
 #ifndef TEST_MODE
         GICR = (1 << IVCE);  /* enable change of interrupt vectors */
         GICR = (1 << IVSEL); /* move interrupts to boot flash section */
@@ -298,12 +1112,27 @@ int __attribute__((noreturn)) main(void)
         do{ /* main event loop */
             wdt_reset();
             usbPoll();
+#if BOOTLOADER_ASYNC_WRITE
+            commitStep();
+#endif
+#if BOOTLOADER_CAN_EEPROM
+            eepromStep();
+#endif
 #if TIMEOUT_ENABLED
             if (TIFR1 & (1 << OCF1A)){
                 inactivity_timer_nsec++;
                 TIFR1 = (1 << OCF1A); // clear interrupt
             }
             if (inactivity_timer_nsec >= TIMEOUT_DURATION){
+#if BOOTLOADER_APP_CHECK
+                /* don't start a damaged application, wait for the host */
+                inactivity_timer_nsec = 0;
+#if BOOTLOADER_ASYNC_WRITE
+                commitFlush();
+#endif
+                if(!appIsValid())
+                    continue;
+#endif
                 /* turn on red LED to signal boot loader has timed out */
                 DDRC |= (1 << PC1);  // turn on red LED
                 break;
@@ -314,13 +1143,34 @@ int __attribute__((noreturn)) main(void)
 #if F_CPU == 12800000
                 break;  /* memory is tight at 12.8 MHz, save exit delay below */
 #endif
-                if(--i == 0){
-                    if(--j == 0)
-                        break;
+                /* The driver sets usbTxLen to NAK when the host has fetched
+                 * the (empty) status stage which was prepared for the exit
+                 * request. Then the host only needs to see our handshake.
+                 */
+                if(usbTxLen == USBPID_NAK || --exitMainloop == 0){
+                    _delay_ms(BOOTLOADER_EXIT_DELAY);
+                    break;
                 }
+                _delay_ms(1);
             }
 #endif
+#if BOOTLOADER_APP_CHECK
+            /* Check the application again when the host is done programming,
+             * so that it starts without a reset once the jumper is removed.
+             */
+#if BOOTLOADER_ASYNC_WRITE
+            if(appChanged && !appValid && !bootLoaderCondition() && !commitIsBusy()){
+                commitFlush();  /* makes the flash readable */
+#else
+            if(appChanged && !appValid && !bootLoaderCondition()){
+#endif
+                appChanged = 0;
+                appIsValid();
+            }
+        }while(bootLoaderCondition() || !appValid);
+#else
         }while(bootLoaderCondition());
+#endif
     }
     leaveBootloader();
 }
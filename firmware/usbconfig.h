@@ -75,11 +75,18 @@ the newest features and options.
  * transfers. Set it to 0 if you don't need it and want to save a couple of
  * bytes.
  */
-#define USB_CFG_IMPLEMENT_FN_READ       0
+#define USB_CFG_IMPLEMENT_FN_READ       BOOTLOADER_CAN_READ
 /* Set this to 1 if you need to send control replies which are generated
  * "on the fly" when usbFunctionRead() is called. If you only want to send
  * data from a static buffer, set it to 0 and return the data from
  * usbFunctionSetup(). This saves a couple of bytes.
+ * The flash readback report streams data with usbFunctionRead().
+ */
+#define USB_CFG_LONG_TRANSFERS          BOOTLOADER_CAN_LONG_WRITE
+/* Define this to 1 if you want to send/receive blocks of more than 254 bytes
+ * in a single control-in or control-out transfer. Note that the capability
+ * for long transfers increases the driver size.
+ * The large data report (report 7) needs this.
  */
 #define USB_CFG_IMPLEMENT_FN_WRITEOUT   0
 /* Define this to 1 if you want to use interrupt-out (or bulk out) endpoint 1.
@@ -91,6 +98,14 @@ the newest features and options.
  * of the macros usbDisableAllRequests() and usbEnableAllRequests() in
  * usbdrv.h.
  */
+#define USB_CFG_CHECK_DATA_TOGGLING     BOOTLOADER_CHECK_TOGGLE
+/* define this macro to 1 if you want to filter out duplicate data packets
+ * sent by the host. Duplicates occur only as a consequence of communication
+ * errors, when the host does not receive an ACK. Please note that you need to
+ * implement the filtering yourself in usbFunctionWriteOut() and
+ * usbFunctionWrite(). Use the global usbCurrentDataToken and a static variable
+ * for each control- and out-endpoint to check for duplicate packets.
+ */
 #define TIMER0_PRESCALING           64 /* must match the configuration for TIMER0 in main */
 #define TOLERATED_DEVIATION_PPT     5  /* max clock deviation before we tune in 1/10 % */
 /* derived constants: */
@@ -141,6 +156,13 @@ tuningOverflow:
  * Please note that Start Of Frame detection works only if D- is wired to the
  * interrupt, not D+. THIS IS DIFFERENT THAN MOST EXAMPLES!
  */
+#if BOOTLOADER_CHECK_CRC && !defined(__ASSEMBLER__)
+#   define USB_RX_USER_HOOK(data, len)  usbRxCheckCrc(data, len);
+#endif
+/* This macro (if defined) is executed in usbProcessRx() for every received
+ * packet. The boot loader uses it to check the CRC16 of the packet, which
+ * the driver does not do.
+ */
 
 /* -------------------------- Device Description --------------------------- */
 
@@ -194,7 +216,9 @@ tuningOverflow:
 /* See USB specification if you want to conform to an existing device class or
  * protocol.
  */
-#define USB_CFG_HID_REPORT_DESCRIPTOR_LENGTH    33  /* total length of report descriptor */
+#define USB_CFG_HID_REPORT_DESCRIPTOR_LENGTH    (33 + 9 * (BOOTLOADER_CAN_ERASE + (BOOTLOADER_CAN_CRC || BOOTLOADER_CAN_READ) + \
+    BOOTLOADER_CAN_CRC + BOOTLOADER_CAN_READ + BOOTLOADER_ASYNC_WRITE + BOOTLOADER_CAN_EEPROM + BOOTLOADER_CAN_SIGNATURE) + \
+    10 * BOOTLOADER_CAN_LONG_WRITE)  /* total length of report descriptor, see main.c */
 /* Define this to the length of the HID report descriptor, if you implement
  * an HID device. Otherwise don't define it or define it to 0.
  */